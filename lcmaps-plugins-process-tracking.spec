@@ -43,6 +43,7 @@ rm -rf $RPM_BUILD_ROOT
 %defattr(-,root,root,-)
 %{_libdir}/lcmaps/lcmaps_process_tracking.mod
 %{_datadir}/%{name}/process-tracking
+%{_datadir}/%{name}/process-tracking-stats
 
 %changelog
 * Mon Aug 13 2012 Brian Bockelman <bbockelm@cse.unl.edu> - 0.2-1
@@ -0,0 +1,726 @@
+
+/**
+ * Benchmarks for the process-tracking hot paths.  Run with `make bench`.
+ *
+ * Nothing here needs root or the proc connector: the /proc scan is timed
+ * against real (idle) child processes; the tree reconciliation and the
+ * fork, exit, usage and teardown paths run on synthetic snapshots and trees
+ * (wide, deep, bushy, churning, among many ignored pids, and many trackers
+ * side by side) using pids above
+ * PID_MAX_LIMIT, so that no real process can ever be signalled.  The teardown benchmark signals only a
+ * fork bomb of its own, fed to the tree through /proc resyncs.
+ *
+ * With -m, the exit-to-kill latency of a real monitor binary is measured
+ * too; that one needs root, for the proc connector.
+ */
+
+#include "config.h"
+
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_keeper.h"
+#include "proc_scan.h"
+#include "proc_util.h"
+
+/**
+ * Time getdents64/openat scans of the real /proc with `children` extra idle
+ * processes alive, then reconcile a tree rooted at ourselves with it.
+ */
+static int bench_scan(unsigned int children, unsigned int rounds) {
+    pid_t *kids = calloc(children, sizeof *kids);
+    struct proc_snapshot snap;
+    struct timespec start, end;
+    unsigned int idx, spawned = 0;
+    int result = 0;
+
+    memset(&snap, 0, sizeof snap);
+    if (!kids) {
+        return -ENOMEM;
+    }
+    for (idx = 0; idx < children; idx++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "fork failed after %u children: %s\n", spawned, strerror(errno));
+            break;
+        } else if (pid == 0) {
+            pause();
+            _exit(0);
+        }
+        kids[spawned++] = pid;
+    }
+
+    double best = 0, total = 0;
+    for (idx = 0; idx < rounds; idx++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ((result = proc_snapshot_take(&snap)) < 0) {
+            goto cleanup;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = ms_between(&start, &end);
+        total += ms;
+        if (!idx || (ms < best)) {
+            best = ms;
+        }
+    }
+    printf("proc scan:     %6u pids   best %8.3f ms   mean %8.3f ms   %6.2f us/pid   (~%.1f ms at 50k pids)\n",
+        snap.count, best, total / rounds, best * 1e3 / snap.count, best * 50000 / snap.count);
+
+    initialize(getpid(), getppid());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int changes = processResync(&snap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("proc resync:   %6u pids   %8.3f ms   adopted %d of %u children\n",
+        snap.count, ms_between(&start, &end), changes, spawned);
+    finalize();
+
+cleanup:
+    for (idx = 0; idx < spawned; idx++) {
+        kill(kids[idx], SIGKILL);
+    }
+    for (idx = 0; idx < spawned; idx++) {
+        waitpid(kids[idx], NULL, 0);
+    }
+    proc_snapshot_free(&snap);
+    free(kids);
+    return result;
+}
+
+/**
+ * Time reconciliation alone on a synthetic node of `total` pids, `payload`
+ * of which descend from the watched process: first adopting the whole
+ * payload (the worst case, an overflow right after startup), then with
+ * nothing to change, then after a tenth of the payload has exited.
+ */
+static int bench_resync(unsigned int total, unsigned int payload) {
+    struct proc_snapshot snap;
+    struct timespec start, end;
+    unsigned int idx;
+    pid_t watched = FAKE_PID_BASE, trigger = FAKE_PID_BASE - 1;
+    int result = 0;
+
+    memset(&snap, 0, sizeof snap);
+    srandom(1);
+    if ((result = proc_snapshot_add(&snap, trigger, 1)) < 0
+            || (result = proc_snapshot_add(&snap, watched, trigger)) < 0) {
+        goto cleanup;
+    }
+    // Each payload process descends from a random earlier one: a mix of
+    // wide and deep subtrees.
+    for (idx = 1; idx <= payload; idx++) {
+        pid_t parent = watched + (random() % idx);
+        if ((result = proc_snapshot_add(&snap, watched + idx, parent)) < 0) {
+            goto cleanup;
+        }
+    }
+    for (idx = snap.count; idx < total; idx++) {
+        if ((result = proc_snapshot_add(&snap, watched + idx, 1)) < 0) {
+            goto cleanup;
+        }
+    }
+
+    initialize(watched, trigger);
+    const char *labels[] = {"cold", "steady", "10% exited"};
+    for (idx = 0; idx < 3; idx++) {
+        if (idx == 2) {
+            unsigned int pos, kept = 0;
+            for (pos = 0; pos < snap.count; pos++) {
+                if ((pos < 2) || (pos % 10)) {
+                    snap.pid[kept] = snap.pid[pos];
+                    snap.ppid[kept] = snap.ppid[pos];
+                    kept++;
+                }
+            }
+            snap.count = kept;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int changes = processResync(&snap);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("resync %-10s %6u pids   %8.3f ms   %d changes\n",
+            labels[idx], snap.count, ms_between(&start, &end), changes);
+    }
+    finalize();
+
+cleanup:
+    proc_snapshot_free(&snap);
+    return result;
+}
+
+/**
+ * Time processFork/processExit for a tree that churns `live` children
+ * through `events` fork/exit pairs, plus `foreign` unrelated pids per fork
+ * pair, which must be rejected as cheaply as possible.
+ */
+static int bench_churn(unsigned int live, unsigned int events, unsigned int foreign) {
+    struct timespec start, end;
+    pid_t watched = FAKE_PID_BASE, trigger = FAKE_PID_BASE - 1;
+    pid_t next = watched + 1;
+    unsigned int idx, sub;
+
+    initialize(watched, trigger);
+    for (idx = 0; idx < live; idx++) {
+        processFork(watched + (idx ? (random() % idx) : 0), next++);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (idx = 0; idx < events; idx++) {
+        // Replace the oldest live child with a new one.
+        pid_t oldest = next - live;
+        processFork(oldest + 1 + (random() % (live - 1)), next++);
+        processExit(oldest, 0);
+        for (sub = 0; sub < foreign; sub++) {
+            processFork(1, 10 + sub);
+            processExit(10 + sub, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t bytes = memory_footprint();
+    finalize();
+    double ms = ms_between(&start, &end);
+    printf("churn:         %6u live   %u fork+exit pairs (+%u foreign each)   %8.3f ms   %6.1f ns/event   %zu KiB of tables\n",
+        live, events, foreign, ms, ms * 1e6 / (2.0 * events * (1 + foreign)), bytes / 1024);
+    return 0;
+}
+
+/**
+ * Churn `count` independent trackers side by side, `live` children each,
+ * with events round-robin across them as a node full of payloads would
+ * deliver them.  Every tracker watches the same pids, so any state leaking
+ * between them shows up as a tree that does not finish.
+ */
+static int bench_trackers(unsigned int count, unsigned int live, unsigned int events) {
+    struct tracker **trackers = calloc(count, sizeof *trackers);
+    struct timespec start, end;
+    pid_t watched = FAKE_PID_BASE, trigger = FAKE_PID_BASE - 1;
+    pid_t next = watched + 1;
+    unsigned int idx, sub;
+    int result = 0;
+
+    if (!trackers) {
+        return -ENOMEM;
+    }
+    for (sub = 0; sub < count; sub++) {
+        if (!(trackers[sub] = tracker_create())) {
+            result = -ENOMEM;
+            goto cleanup;
+        }
+        tracker_register(trackers[sub], watched, trigger);
+    }
+    for (idx = 0; idx < live; idx++, next++) {
+        for (sub = 0; sub < count; sub++) {
+            tracker_fork(trackers[sub], watched + (idx ? (random() % idx) : 0), next);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (idx = 0; idx < events; idx++, next++) {
+        pid_t oldest = next - live;
+        pid_t parent = oldest + 1 + (random() % (live - 1));
+        for (sub = 0; sub < count; sub++) {
+            tracker_fork(trackers[sub], parent, next);
+            tracker_exit(trackers[sub], oldest);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t bytes = 0;
+    for (sub = 0; sub < count; sub++) {
+        bytes += tracker_footprint(trackers[sub]);
+        for (idx = 0; idx <= live; idx++) {
+            tracker_exit(trackers[sub], next - idx);
+        }
+        tracker_exit(trackers[sub], watched);
+        if (!tracker_is_done(trackers[sub])) {
+            fprintf(stderr, "tracker %u was not empty after every exit\n", sub);
+            result = -EPROTO;
+        }
+    }
+    double ms = ms_between(&start, &end);
+    printf("trackers:      %6u x %u live   %u fork+exit pairs each   %8.3f ms   %6.1f ns/event   %zu KiB of tables\n",
+        count, live, events, ms, ms * 1e6 / (2.0 * events * count), bytes / 1024);
+
+cleanup:
+    for (sub = 0; sub < count; sub++) {
+        if (trackers[sub]) {
+            tracker_destroy(trackers[sub]);
+        }
+    }
+    free(trackers);
+    return result;
+}
+
+// Parents for the synthetic tree shapes; member idx is watched + idx.
+static pid_t wide_parent(pid_t watched, unsigned int idx) {
+    return watched;
+}
+
+static pid_t deep_parent(pid_t watched, unsigned int idx) {
+    return watched + idx - 1;
+}
+
+static pid_t bushy_parent(pid_t watched, unsigned int idx) {
+    return watched + (random() % idx);
+}
+
+/**
+ * Time each hot path on a synthetic tree of `size` members: the forks that
+ * build it, one usage pass, the SIGSTOP pass of the teardown when the
+ * watched process exits, and the exits that empty it, newest first.  No
+ * pid is real, so a usage pass costs the walk plus a failed open per pid,
+ * and every signal fails with ESRCH.
+ */
+static int bench_shape(const char *name, pid_t (*parent)(pid_t, unsigned int), unsigned int size) {
+    struct timespec start, mid, end;
+    pid_t watched = FAKE_PID_BASE, trigger = FAKE_PID_BASE - 1;
+    unsigned int idx;
+
+    srandom(1);
+    initialize(watched, trigger);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (idx = 1; idx <= size; idx++) {
+        processFork(parent(watched, idx), watched + idx);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double fork_ms = ms_between(&start, &end);
+    size_t bytes = memory_footprint();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    processUsage();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double usage_ms = ms_between(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    processExit(watched, 0);
+    clock_gettime(CLOCK_MONOTONIC, &mid);
+    for (idx = size; idx >= 1; idx--) {
+        processExit(watched + idx, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int done = is_done();
+    finalize();
+    if (!done) {
+        fprintf(stderr, "%s tree was not empty after every exit\n", name);
+        return -EPROTO;
+    }
+    printf("shape %-8s %6u pids   fork %6.1f ns   usage %6.2f us/pid   stop pass %8.3f ms   exit %6.1f ns   %zu KiB of tables\n",
+        name, size, fork_ms * 1e6 / size, usage_ms * 1e3 / size, ms_between(&start, &mid),
+        ms_between(&mid, &end) * 1e6 / size, bytes / 1024);
+    return 0;
+}
+
+// Keeps the compiler from dropping the samples.
+static volatile unsigned long g_sink;
+
+/*
+ * How usage sampling used to read a pid (proc_keeper.cxx also built the
+ * path with a std::stringstream).  fscanf's %s stops at the first space,
+ * so a command name with spaces in it shifted every field after it.
+ */
+static int legacy_measure_cpu(pid_t pid, unsigned long *utime, unsigned long *stime) {
+    char path[32];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -errno;
+    }
+    int ret = fscanf(file, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        utime, stime);
+    fclose(file);
+    return (ret == 2) ? 0 : -EPROTO;
+}
+
+/**
+ * Time one usage sample of 1k, 10k and 50k tracked pids, opening and
+ * fscanf'ing each one as we used to, and with pread on fds kept open.  The
+ * pids are `children` idle processes, each sampled several times over if
+ * there are fewer of them; the fd limit caps the larger sizes.
+ */
+static int bench_sample(unsigned int children, unsigned int rounds) {
+    static const unsigned int sizes[] = {1000, 10000, 50000};
+    pid_t *kids = calloc(children ? children : 1, sizeof *kids);
+    unsigned int idx, spawned = 0, size;
+    struct timespec start, end;
+
+    if (!kids) {
+        return -ENOMEM;
+    }
+    for (idx = 0; idx < children; idx++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "fork failed after %u children: %s\n", spawned, strerror(errno));
+            break;
+        } else if (pid == 0) {
+            pause();
+            _exit(0);
+        }
+        kids[spawned++] = pid;
+    }
+    if (!spawned) {
+        kids[spawned++] = getpid();
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    for (size = 0; size < sizeof sizes / sizeof *sizes; size++) {
+        unsigned int count = sizes[size];
+        if (count + 64 > rl.rlim_cur) {
+            count = rl.rlim_cur - 64;
+        }
+        int *fds = malloc(count * sizeof *fds);
+        if (!fds) {
+            break;
+        }
+        unsigned long utime, stime, sum = 0;
+        double best_old = 0, best_new = 0;
+        unsigned int round;
+        for (round = 0; round < rounds; round++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (idx = 0; idx < count; idx++) {
+                if (legacy_measure_cpu(kids[idx % spawned], &utime, &stime) == 0) {
+                    sum += utime;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = ms_between(&start, &end);
+            if (!round || (ms < best_old)) {
+                best_old = ms;
+            }
+        }
+        // Opening happens once per pid, when it is first sampled.
+        for (idx = 0; idx < count; idx++) {
+            fds[idx] = stat_open(kids[idx % spawned]);
+        }
+        for (round = 0; round < rounds; round++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (idx = 0; idx < count; idx++) {
+                if ((fds[idx] >= 0) && (stat_read_cpu(fds[idx], &utime, &stime) == 0)) {
+                    sum += utime;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = ms_between(&start, &end);
+            if (!round || (ms < best_new)) {
+                best_new = ms;
+            }
+        }
+        for (idx = 0; idx < count; idx++) {
+            if (fds[idx] >= 0) {
+                close(fds[idx]);
+            }
+        }
+        free(fds);
+        printf("usage sample:  %6u pids   fopen+fscanf %8.3f ms   pread %8.3f ms   %5.2f us/pid vs %5.2f   (%.1fx)%s\n",
+            count, best_old, best_new, best_old * 1e3 / count, best_new * 1e3 / count, best_old / best_new,
+            (count < sizes[size]) ? "   capped by RLIMIT_NOFILE" : "");
+        g_sink = sum;
+    }
+
+    for (idx = 0; idx < spawned; idx++) {
+        if (kids[idx] != getpid()) {
+            kill(kids[idx], SIGKILL);
+            waitpid(kids[idx], NULL, 0);
+        }
+    }
+    free(kids);
+    return 0;
+}
+
+/**
+ * A fork bomb: every process forks until `cap` processes exist, then keeps
+ * forking short-lived children so the tree never stops changing.
+ */
+static void fork_bomb(unsigned int *population, unsigned int cap) {
+    while (1) {
+        if (__atomic_add_fetch(population, 1, __ATOMIC_RELAXED) <= cap) {
+            if (fork() == 0) {
+                continue;
+            }
+        } else {
+            __atomic_sub_fetch(population, 1, __ATOMIC_RELAXED);
+            pid_t pid = fork();
+            if (pid == 0) {
+                _exit(0);
+            } else if (pid > 0) {
+                waitpid(pid, NULL, 0);
+            }
+        }
+    }
+}
+
+/**
+ * Time from the watched process dying to an empty tree, against a fork
+ * bomb of `cap` processes.  Without the proc connector, the tree learns of
+ * forks and exits from back-to-back /proc resyncs, so this is an upper
+ * bound on what the monitor achieves.
+ */
+static int bench_teardown(unsigned int cap) {
+    struct proc_snapshot snap;
+    struct timespec start, end;
+    unsigned int scans = 0;
+    int result = 0;
+
+    memset(&snap, 0, sizeof snap);
+    unsigned int *population = mmap(NULL, sizeof *population, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (population == MAP_FAILED) {
+        return -errno;
+    }
+    *population = 0;
+    // Orphaned bomb processes are reparented to us, so we can reap them.
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    pid_t watched = fork();
+    if (watched == -1) {
+        result = -errno;
+        goto cleanup;
+    } else if (watched == 0) {
+        setpgid(0, 0);
+        // Otherwise the bomb starves the "monitor" of CPU and that is all
+        // we would measure.
+        if (nice(19) == -1) {}
+        if (fork() == 0) {
+            fork_bomb(population, cap);
+        }
+        pause();
+        _exit(0);
+    }
+    setpgid(watched, watched);
+    while (__atomic_load_n(population, __ATOMIC_RELAXED) < cap) {
+        usleep(1000);
+    }
+
+    initialize(watched, getpid());
+    if ((result = proc_snapshot_take(&snap)) < 0) {
+        goto cleanup;
+    }
+    int members = processResync(&snap);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kill(watched, SIGKILL);
+    waitpid(watched, NULL, 0);
+    while (!is_done()) {
+        if ((result = proc_snapshot_take(&snap)) < 0) {
+            goto cleanup;
+        }
+        processResync(&snap);
+        processTeardown();
+        while (waitpid(-1, NULL, WNOHANG) > 0) {}
+        scans++;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (ms_between(&start, &end) > 30000) {
+            fprintf(stderr, "teardown did not finish within 30 s\n");
+            result = -ETIMEDOUT;
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!result) {
+        printf("teardown:      %6d pids   %8.3f ms to an empty tree   %u /proc scans\n",
+            members, ms_between(&start, &end), scans);
+    }
+    finalize();
+
+cleanup:
+    kill(-watched, SIGKILL);
+    while (waitpid(-1, NULL, 0) > 0) {}
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+    proc_snapshot_free(&snap);
+    munmap(population, sizeof *population);
+    return result;
+}
+
+/**
+ * Flood the kernel queue with fork/exit pairs of processes nobody tracks.
+ */
+static void flood() {
+    setpgid(0, 0);
+    // Leave the monitor the CPU: the queue is what we want to fill.
+    if (nice(19) == -1) {}
+    while (1) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(0);
+        } else if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+}
+
+/**
+ * Time from the watched process exiting to its child being killed by the
+ * `monitor` binary, `trials` times over, while `floods` processes fill the
+ * event queue.  The child is reparented to us, so its death is a waitpid.
+ */
+static int bench_exit_latency(const char *monitor, unsigned int floods, unsigned int trials) {
+    pid_t flooders[floods ? floods : 1];
+    unsigned int idx, done = 0;
+    double total = 0, worst = 0;
+    int result = 0;
+
+    double *exited = mmap(NULL, sizeof *exited, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (exited == MAP_FAILED) {
+        return -errno;
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    for (idx = 0; idx < floods; idx++) {
+        if ((flooders[idx] = fork()) == 0) {
+            flood();
+        }
+    }
+
+    for (idx = 0; idx < trials; idx++) {
+        int go[2], ready[2];
+        struct timespec now;
+        char byte;
+        if ((pipe(go) == -1) || (pipe(ready) == -1)) {
+            result = -errno;
+            break;
+        }
+        pid_t watched = fork();
+        if (watched == 0) {
+            setpgid(0, 0);
+            if (fork() == 0) {
+                pause();
+                _exit(0);
+            }
+            if (read(go[0], &byte, 1) != 1) {}
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            *exited = now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+            _exit(0);
+        }
+        close(go[0]);
+        pid_t mon = fork();
+        if (mon == 0) {
+            char pid_arg[16], ppid_arg[16];
+            dup2(ready[1], 1);
+            snprintf(pid_arg, sizeof pid_arg, "%d", watched);
+            snprintf(ppid_arg, sizeof ppid_arg, "%d", getppid());
+            execl(monitor, monitor, pid_arg, ppid_arg, (char *)NULL);
+            _exit(127);
+        }
+        close(ready[1]);
+        // The monitor writes one byte once it is tracking.
+        int started = (read(ready[0], &byte, 1) == 1);
+        close(ready[0]);
+        if (!started) {
+            fprintf(stderr, "%s did not start\n", monitor);
+            kill(-watched, SIGKILL);
+            close(go[1]);
+            result = -ECHILD;
+            break;
+        }
+        usleep(100000);
+        if (write(go[1], "x", 1) != 1) {}
+        close(go[1]);
+        waitpid(watched, NULL, 0);
+
+        // Anything else we reap now is the orphaned child.
+        double deadline = 0, ms = 0;
+        while (1) {
+            pid_t pid = waitpid(-1, NULL, WNOHANG);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ms = now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+            if (!deadline) {
+                deadline = ms + 30000;
+            }
+            if ((pid > 0) && (pid != mon)) {
+                break;
+            } else if ((pid < 0) || (ms > deadline)) {
+                fprintf(stderr, "child of %d was not killed within 30 s\n", watched);
+                kill(-watched, SIGKILL);
+                break;
+            }
+            usleep(100);
+        }
+        ms -= *exited;
+        total += ms;
+        if (ms > worst) {
+            worst = ms;
+        }
+        done++;
+        kill(mon, SIGTERM);
+        waitpid(mon, NULL, 0);
+    }
+    if (done) {
+        printf("exit to kill:  %6u floods %8.3f ms mean   %8.3f ms worst   over %u trials\n",
+            floods, total / done, worst, done);
+    }
+
+    for (idx = 0; idx < floods; idx++) {
+        kill(-flooders[idx], SIGKILL);
+    }
+    while (waitpid(-1, NULL, 0) > 0) {}
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+    munmap(exited, sizeof *exited);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int children = 1000, total = 50000, payload = 5000, bomb = 1000, floods = 8;
+    const char *monitor = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:f:m:n:p:")) != -1) {
+        switch (opt) {
+            case 'b': bomb = atoi(optarg); break;
+            case 'c': children = atoi(optarg); break;
+            case 'f': floods = atoi(optarg); break;
+            case 'm': monitor = optarg; break;
+            case 'n': total = atoi(optarg); break;
+            case 'p': payload = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-b fork bomb size] [-c idle children] [-n synthetic pids] [-p synthetic payload pids]\n"
+                    "          [-m monitor binary [-f flood processes]]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (payload + 2 > total) {
+        payload = total - 2;
+    }
+
+    openlog("process-tracking-bench", LOG_PID, LOG_DAEMON);
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    if (bench_scan(children, 10) < 0) {
+        return 1;
+    }
+    if (bench_resync(total, payload) < 0) {
+        return 1;
+    }
+    // Sampling keeps one fd per pid, as the monitor does.
+    struct rlimit rl;
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < rl.rlim_max)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (bench_sample(children, 5) < 0) {
+        return 1;
+    }
+    // Time whole usage passes, not whatever fits the default budget.
+    set_usage_budget(100);
+    if ((bench_shape("wide", wide_parent, payload) < 0)
+            || (bench_shape("deep", deep_parent, payload) < 0)
+            || (bench_shape("bushy", bushy_parent, payload) < 0)) {
+        return 1;
+    }
+    bench_churn(payload, 1000000, 4);
+    // Most of what a busy node forks is nobody's business.
+    bench_churn(payload, 100000, 64);
+    if (bench_trackers(16, payload / 16, 100000) < 0) {
+        return 1;
+    }
+    if (bomb && (bench_teardown(bomb) < 0)) {
+        return 1;
+    }
+    if (monitor && ((bench_exit_latency(monitor, 0, 10) < 0)
+            || (floods && (bench_exit_latency(monitor, floods, 10) < 0)))) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_cgroup.h"
+
+static int write_file(const char *path, const char *name, const char *value) {
+    char file[PATH_MAX];
+    if (snprintf(file, sizeof file, "%s/%s", path, name) >= (int)sizeof file) {
+        return -ENAMETOOLONG;
+    }
+    int fd = open(file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -errno;
+    }
+    size_t len = strlen(value);
+    int result = 0;
+    if (write(fd, value, len) != (ssize_t)len) {
+        result = errno ? -errno : -EIO;
+    }
+    close(fd);
+    return result;
+}
+
+static ssize_t read_file(const char *path, const char *name, char *buf, size_t len) {
+    char file[PATH_MAX];
+    if (snprintf(file, sizeof file, "%s/%s", path, name) >= (int)sizeof file) {
+        return -ENAMETOOLONG;
+    }
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -errno;
+    }
+    ssize_t count = read(fd, buf, len - 1);
+    if (count == -1) {
+        count = -errno;
+    } else {
+        buf[count] = '\0';
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * Create the payload's cgroup below a delegated parent.  The name is fixed
+ * by the pid, so a leftover from a recycled pid is simply reused.
+ */
+int cgroup_create(const char *parent, pid_t pid, char *path, size_t len) {
+    if (snprintf(path, len, "%s/glexec-%d", parent, pid) >= (int)len) {
+        return -ENAMETOOLONG;
+    }
+    if ((mkdir(path, 0755) == -1) && (errno != EEXIST)) {
+        return -errno;
+    }
+    return 0;
+}
+
+int cgroup_attach(const char *path, pid_t pid) {
+    char value[32];
+    snprintf(value, sizeof value, "%d\n", pid);
+    return write_file(path, "cgroup.procs", value);
+}
+
+int cgroup_check(const char *path) {
+    char file[PATH_MAX];
+    if (snprintf(file, sizeof file, "%s/cgroup.procs", path) >= (int)sizeof file) {
+        return -ENAMETOOLONG;
+    }
+    if (access(file, W_OK) == -1) {
+        syslog(LOG_ERR, "Unusable payload cgroup %s: %d %s\n", path, errno, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Kill every process in the cgroup.  cgroup.kill does this atomically in
+ * the kernel, including anything forked while it runs.  Kernels before 5.14
+ * lack it; there we freeze the cgroup so nothing can fork, signal each
+ * member, and thaw so the signals are delivered.
+ */
+int cgroup_kill(const char *path) {
+    int result = write_file(path, "cgroup.kill", "1");
+    if (result != -ENOENT) {
+        if (result < 0) {
+            syslog(LOG_ERR, "Unable to kill cgroup %s: %d %s\n", path, -result, strerror(-result));
+        }
+        return result;
+    }
+
+    if ((result = write_file(path, "cgroup.freeze", "1")) < 0) {
+        syslog(LOG_ERR, "Unable to freeze cgroup %s: %d %s\n", path, -result, strerror(-result));
+    }
+    char file[PATH_MAX];
+    snprintf(file, sizeof file, "%s/cgroup.procs", path);
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        result = -errno;
+        syslog(LOG_ERR, "Unable to list cgroup %s: %d %s\n", path, errno, strerror(errno));
+    } else {
+        int pid;
+        while (fscanf(fp, "%d", &pid) == 1) {
+            if ((kill(pid, SIGKILL) == -1) && (errno != ESRCH)) {
+                syslog(LOG_ERR, "FAILURE TO KILL %d: %d %s\n", pid, errno, strerror(errno));
+            }
+        }
+        fclose(fp);
+        result = 0;
+    }
+    write_file(path, "cgroup.freeze", "0");
+    return result;
+}
+
+/**
+ * Read the payload's totals: one read each of cpu.stat, memory.peak and
+ * io.stat.  Files for controllers that are not enabled are skipped.
+ */
+int cgroup_read_usage(const char *path, struct cgroup_usage *usage) {
+    char buf[4096];
+    char *line, *save;
+    memset(usage, 0, sizeof *usage);
+
+    ssize_t count = read_file(path, "cpu.stat", buf, sizeof buf);
+    if (count < 0) {
+        return count;
+    }
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        sscanf(line, "user_usec %llu", &usage->user_usec);
+        sscanf(line, "system_usec %llu", &usage->system_usec);
+    }
+
+    if (read_file(path, "memory.peak", buf, sizeof buf) > 0) {
+        usage->memory_peak = strtoull(buf, NULL, 10);
+    }
+
+    if (read_file(path, "io.stat", buf, sizeof buf) > 0) {
+        // One line per device: "MAJ:MIN rbytes=N wbytes=N rios=N ..."
+        for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            char *field;
+            if ((field = strstr(line, "rbytes="))) {
+                usage->io_rbytes += strtoull(field + 7, NULL, 10);
+            }
+            if ((field = strstr(line, "wbytes="))) {
+                usage->io_wbytes += strtoull(field + 7, NULL, 10);
+            }
+        }
+    }
+    return 0;
+}
+
+int cgroup_remove(const char *path) {
+    if (rmdir(path) == -1) {
+        syslog(LOG_ERR, "Unable to remove cgroup %s: %d %s\n", path, errno, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+
+// cgroup v2 containment: each payload runs in its own cgroup below a
+// delegated parent, so it can be killed with one write and accounted from
+// the cgroup's own counters.
+
+#ifndef __PROC_CGROUP_H
+#define __PROC_CGROUP_H
+
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cgroup_usage {
+    unsigned long long user_usec;
+    unsigned long long system_usec;
+    unsigned long long memory_peak;  // bytes; 0 without the memory controller
+    unsigned long long io_rbytes;    // 0 without the io controller
+    unsigned long long io_wbytes;
+};
+
+// Used by the plugin; these do not log.
+int cgroup_create(const char *parent, pid_t pid, char *path, size_t len);
+int cgroup_attach(const char *path, pid_t pid);
+
+// Used by the monitor.
+int cgroup_check(const char *path);
+int cgroup_kill(const char *path);
+int cgroup_read_usage(const char *path, struct cgroup_usage *);
+int cgroup_remove(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,298 @@
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_daemon.h"
+#include "proc_keeper.h"
+#include "proc_log.h"
+#include "proc_scan.h"
+#include "proc_cgroup.h"
+#include "proc_trace.h"
+#include "proc_loop.h"
+#include "proc_util.h"
+
+/**
+ * Create the listening socket the plugin registers new payloads on.
+ * Only root may connect; see handle_registration.
+ */
+int create_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        syslog(LOG_ERR, "Control socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Non-blocking, so that every queued registration can be accepted in
+    // one go; accepted connections stay blocking.
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        syslog(LOG_ERR, "Unable to create control socket: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "Unable to manipulate control socket flags: %d %s\n", errno, strerror(errno));
+        close(sock);
+        return -errno;
+    }
+
+    // Remove the socket left behind by a previous daemon.
+    if ((unlink(path) == -1) && (errno != ENOENT)) {
+        syslog(LOG_ERR, "Unable to remove stale control socket %s: %d %s\n", path, errno, strerror(errno));
+        close(sock);
+        return -errno;
+    }
+    mode_t old_mask = umask(077);
+    int result = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    umask(old_mask);
+    if (result == -1) {
+        syslog(LOG_ERR, "Unable to bind control socket %s: %d %s\n", path, errno, strerror(errno));
+        close(sock);
+        return -errno;
+    }
+    if (listen(sock, SOMAXCONN) == -1) {
+        syslog(LOG_ERR, "Unable to listen on control socket %s: %d %s\n", path, errno, strerror(errno));
+        close(sock);
+        return -errno;
+    }
+    return sock;
+}
+
+/**
+ * Returns -EAGAIN, without logging, if flags has MSG_DONTWAIT and the
+ * request has not arrived yet.
+ */
+static int read_request(int conn, struct tracking_request *req, int *lock_fd, int flags) {
+    struct msghdr msghdr;
+    struct iovec iov[1];
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+
+    *lock_fd = -1;
+    memset(&msghdr, 0, sizeof msghdr);
+    iov[0].iov_base = req;
+    iov[0].iov_len = sizeof *req;
+    msghdr.msg_iov = iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsgbuf;
+    msghdr.msg_controllen = sizeof cmsgbuf;
+
+    ssize_t len;
+    while (((len = recvmsg(conn, &msghdr, MSG_CMSG_CLOEXEC | flags)) < 0) && errno == EINTR) {}
+    if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (flags & MSG_DONTWAIT)) {
+        return -EAGAIN;
+    } else if (len < 0) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to read registration: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)
+                && (cmsg->cmsg_len == CMSG_LEN(sizeof(int)))) {
+            memcpy(lock_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if ((len != sizeof *req) || (msghdr.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Truncated registration (%zd bytes).\n", len);
+        return -EINVAL;
+    }
+    if (req->version != PROC_TRACKING_PROTOCOL) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unknown registration protocol version %u.\n", req->version);
+        return -EPROTO;
+    }
+    req->lockfile[sizeof req->lockfile - 1] = '\0';
+    req->cgroup[sizeof req->cgroup - 1] = '\0';
+    return 0;
+}
+
+// Registrations answered since the trees were last seeded from /proc.
+static int g_seed_pending = 0;
+
+static int answer_registration(int conn, int flags);
+
+// Connections accepted before their request arrived.  They wait in the
+// event loop, never on the thread that owns the trees, and are dropped
+// after REGISTRATION_TIMEOUT_MS.
+struct pending_registration {
+    struct loop_source src;
+    uint64_t accepted_ns;
+};
+static struct pending_registration g_pending[REGISTRATION_BATCH];
+
+static void drop_pending(struct event_loop *loop, struct pending_registration *pending) {
+    loop_remove(loop, &pending->src);
+    close(pending->src.fd);
+    pending->src.fd = -1;
+}
+
+static void on_request(struct event_loop *loop, struct loop_source *src) {
+    struct pending_registration *pending = src->ctx;
+    int conn = src->fd, result;
+    if (conn < 0) {
+        return;
+    }
+    if ((result = answer_registration(conn, MSG_DONTWAIT)) == -EAGAIN) {
+        return;
+    }
+    // answer_registration closed it.
+    loop_remove(loop, src);
+    pending->src.fd = -1;
+    if (result == 0) {
+        g_seed_pending = 1;
+    }
+}
+
+/**
+ * Drop the connections that have waited too long, and return a free slot,
+ * or NULL if all are taken.
+ */
+static struct pending_registration *pending_slot(struct event_loop *loop) {
+    struct pending_registration *slot = NULL;
+    uint64_t now = now_ns();
+    unsigned int idx;
+    for (idx = 0; idx < REGISTRATION_BATCH; idx++) {
+        struct pending_registration *pending = &g_pending[idx];
+        if (pending->src.handler && (pending->src.fd >= 0)
+                && (now - pending->accepted_ns > REGISTRATION_TIMEOUT_MS * 1000000ULL)) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Dropping registration connection that sent nothing for %d ms.\n", REGISTRATION_TIMEOUT_MS);
+            drop_pending(loop, pending);
+        }
+        if (!slot && (!pending->src.handler || (pending->src.fd < 0))) {
+            slot = pending;
+        }
+    }
+    return slot;
+}
+
+/**
+ * Accept the connections queued on the control socket, up to
+ * REGISTRATION_BATCH, and answer those whose request is already there.
+ * The rest wait in the loop until it arrives.  Returns the number
+ * registered, or -errno.
+ */
+int handle_registration(struct event_loop *loop, int ctl_sock) {
+    int count = 0, tries, result;
+    for (tries = 0; tries < REGISTRATION_BATCH; tries++) {
+        int conn = accept4(ctl_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn == -1) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to accept on control socket: %d %s\n", errno, strerror(errno));
+            return -errno;
+        }
+        if ((result = answer_registration(conn, MSG_DONTWAIT)) == 0) {
+            g_seed_pending = 1;
+            count++;
+        } else if (result == -EAGAIN) {
+            struct pending_registration *pending = pending_slot(loop);
+            if (!pending) {
+                log_async(LOG_CAT_ERROR, LOG_ERR, "Too many registrations waiting for their request; dropping one.\n");
+                close(conn);
+                continue;
+            }
+            pending->src.fd = conn;
+            pending->src.handler = on_request;
+            pending->src.ctx = pending;
+            pending->accepted_ns = now_ns();
+            if (loop_add(loop, &pending->src) < 0) {
+                close(conn);
+                pending->src.fd = -1;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Events are flowing, and each payload waits for its answer before it does
+ * anything, so one scan after a burst of registrations covers them all.
+ */
+int seed_registered() {
+    if (!g_seed_pending) {
+        return 0;
+    }
+    g_seed_pending = 0;
+    return proc_seed();
+}
+
+int serve_registration(int conn) {
+    // Only the pool monitor waits like this, before it tracks anything.
+    struct timeval timeout;
+    timeout.tv_sec = REGISTRATION_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (REGISTRATION_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+    return answer_registration(conn, 0);
+}
+
+/**
+ * Register the payload the request on conn describes, send back the
+ * result and close conn.  With MSG_DONTWAIT in flags, returns -EAGAIN and
+ * leaves conn open if the request has not arrived yet.
+ */
+static int answer_registration(int conn, int flags) {
+    int32_t result;
+    int lock_fd = -1;
+    struct tracking_request req;
+    struct ucred cred;
+    socklen_t cred_len = sizeof cred;
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to determine control socket peer: %d %s\n", errno, strerror(errno));
+        result = -errno;
+    } else if (cred.uid != 0) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Rejecting registration from non-root uid %d (pid %d).\n", cred.uid, cred.pid);
+        result = -EPERM;
+    } else if ((result = read_request(conn, &req, &lock_fd, flags)) == -EAGAIN) {
+        return result;
+    } else if (result < 0) {
+        // Already logged.
+    } else if ((req.pid <= 1) || (req.ppid <= 1)) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Invalid registration for pid %d, ppid %d.\n", req.pid, req.ppid);
+        result = -EINVAL;
+    } else if ((kill(req.pid, 0) == -1) && (errno == ESRCH)) {
+        // We would never see its exit; refuse rather than track forever.
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Registration for pid %d, which no longer exists.\n", req.pid);
+        result = -ESRCH;
+    } else {
+        log_async(LOG_CAT_TREE, LOG_INFO, "Process %d monitoring process %d\n", getpid(), req.pid);
+        const char *cgroup = NULL;
+        if (req.cgroup[0] && (cgroup_check(req.cgroup) == 0)) {
+            cgroup = req.cgroup;
+        }
+        trace_register(req.pid, req.ppid);
+        result = register_tree(req.pid, req.ppid, lock_fd, req.lockfile[0] ? req.lockfile : NULL, cgroup);
+        if (result == 0) {
+            // The tree owns the lockfile fd now.
+            lock_fd = -1;
+            log_async(LOG_CAT_TREE, LOG_NOTICE, "TRACKING %d\n", req.pid);
+        }
+    }
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+
+    // A fresh connection always has room for the answer.
+    if (send(conn, &result, sizeof result, MSG_NOSIGNAL | flags) != sizeof result) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to reply to registration: %d %s\n", errno, strerror(errno));
+    }
+    close(conn);
+    return result;
+}
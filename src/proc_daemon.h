@@ -0,0 +1,44 @@
+
+// Registration protocol between the LCMAPS plugin and a long-lived
+// process-tracking daemon, or a pool of idle monitors, spoken over a local
+// unix socket.
+
+#ifndef __PROC_DAEMON_H
+#define __PROC_DAEMON_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#define PROC_TRACKING_SOCKET "/var/run/lcmaps-process-tracking.sock"
+#define PROC_TRACKING_PROTOCOL 2
+
+// Sent by the plugin as a single SOCK_SEQPACKET message.  If a pool account
+// is in use, its lockfile fd travels alongside as SCM_RIGHTS and the daemon
+// holds it until the payload's tree is gone.  If the payload was placed in
+// its own cgroup, cgroup names its directory.  The daemon answers with a
+// single int32_t: 0 on success, -errno otherwise.
+struct tracking_request {
+    uint32_t version;
+    int32_t pid;
+    int32_t ppid;
+    char lockfile[PATH_MAX];
+    char cgroup[PATH_MAX];
+};
+
+int create_control_socket(const char *);
+#define REGISTRATION_BATCH 64
+// How long a client may take to send its request after connecting.
+#define REGISTRATION_TIMEOUT_MS 1000
+// Accept and answer registrations without ever blocking the loop; a
+// connection whose request has not arrived yet waits in the loop for it.
+struct event_loop;
+int handle_registration(struct event_loop *, int);
+// Seed the trees registered by handle_registration from /proc, with one
+// scan however many there were; the event loop calls it once per wake-up.
+int seed_registered();
+// Wait for the registration on an accepted connection, answer it and
+// close the connection.  The caller seeds the new tree from /proc if this
+// returns 0.
+int serve_registration(int);
+
+#endif
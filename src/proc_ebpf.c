@@ -0,0 +1,229 @@
+
+#include "config.h"
+
+#include <linux/types.h>
+#include <linux/cn_proc.h>
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "proc_keeper.h"
+#include "proc_daemon.h"
+#include "proc_ebpf.h"
+#include "proc_ebpf_event.h"
+#include "proc_scan.h"
+#include "proc_taskstats.h"
+#include "proc_loop.h"
+#include "proc_trace.h"
+#include "proc_latency.h"
+#include "proc_stats.h"
+#include "proc_log.h"
+#include "proc_police.h"
+#include "proc_tracking.skel.h"
+
+struct ebpf_tracker {
+    struct proc_tracking_bpf *skel;
+    struct ring_buffer *rb;
+    int tracked_fd;
+    unsigned long long events;
+};
+
+// The track hook carries no context; there is only ever one backend.
+static struct ebpf_tracker *g_tracker = NULL;
+
+static void ebpf_track(pid_t pid, int member) {
+    __u32 key = pid;
+    __u32 flags = 0;
+    if (!g_tracker) {
+        return;
+    }
+    // Keep any flags a different tree has already set for this pid.
+    bpf_map_lookup_elem(g_tracker->tracked_fd, &key, &flags);
+    flags |= member ? TRACK_MEMBER : TRACK_TRIGGER;
+    if (bpf_map_update_elem(g_tracker->tracked_fd, &key, &flags, BPF_ANY)) {
+        syslog(LOG_ERR, "Unable to add pid %d to the eBPF tracked map: %d %s\n", pid, errno, strerror(errno));
+    }
+}
+
+static int handle_event(void *ctx, void *data, size_t size) {
+    struct ebpf_tracker *tracker = ctx;
+    const struct tracking_event *ev = data;
+    if (size < sizeof *ev) {
+        return 0;
+    }
+    tracker->events++;
+    __atomic_fetch_add(&g_loop_stats.events, 1, __ATOMIC_RELAXED);
+    // Only tracked processes get this far, so a clock read each is cheap.
+    uint64_t now = now_ns();
+    latency_record(&g_latency.dispatch, (now > ev->timestamp_ns) ? now - ev->timestamp_ns : 0);
+    switch (ev->what) {
+        case TRACKING_EVENT_FORK:
+            trace_event(PROC_EVENT_FORK, 0, ev->timestamp_ns, ev->tgid, ev->parent_tgid);
+            processFork(ev->parent_tgid, ev->tgid);
+            break;
+        case TRACKING_EVENT_EXIT:
+            trace_event(PROC_EVENT_EXIT, 0, ev->timestamp_ns, ev->tgid, 0);
+            processExit(ev->tgid, ev->timestamp_ns);
+            break;
+        default:
+            break;
+    }
+    __atomic_fetch_add(&g_loop_stats.applied, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int libbpf_log(enum libbpf_print_level level, const char *fmt, va_list args) {
+    if (level == LIBBPF_DEBUG) {
+        return 0;
+    }
+    vsyslog(LOG_DEBUG, fmt, args);
+    return 0;
+}
+
+/**
+ * Load and attach the BPF program.  Returns NULL if this kernel cannot run
+ * it (no BTF, no ring buffer, no privileges); callers fall back to netlink.
+ * Must be called before any tree is registered so the hook sees it.
+ */
+struct ebpf_tracker *ebpf_open() {
+    struct ebpf_tracker *tracker = calloc(1, sizeof *tracker);
+    if (!tracker) {
+        return NULL;
+    }
+    libbpf_set_print(libbpf_log);
+
+    tracker->skel = proc_tracking_bpf__open_and_load();
+    if (!tracker->skel) {
+        syslog(LOG_NOTICE, "Unable to load eBPF tracking program: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    if (proc_tracking_bpf__attach(tracker->skel)) {
+        syslog(LOG_NOTICE, "Unable to attach eBPF tracking program: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    tracker->tracked_fd = bpf_map__fd(tracker->skel->maps.tracked);
+    tracker->rb = ring_buffer__new(bpf_map__fd(tracker->skel->maps.events), handle_event, tracker, NULL);
+    if (!tracker->rb) {
+        syslog(LOG_NOTICE, "Unable to create eBPF ring buffer: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+
+    g_tracker = tracker;
+    set_track_hook(ebpf_track);
+    return tracker;
+
+fail:
+    if (tracker->skel) {
+        proc_tracking_bpf__destroy(tracker->skel);
+    }
+    free(tracker);
+    return NULL;
+}
+
+void ebpf_close(struct ebpf_tracker *tracker) {
+    if (!tracker) {
+        return;
+    }
+    syslog(LOG_DEBUG, "eBPF backend delivered %llu events, dropped %llu.\n",
+        tracker->events, (unsigned long long)tracker->skel->bss->dropped);
+    set_track_hook(NULL);
+    g_tracker = NULL;
+    ring_buffer__free(tracker->rb);
+    proc_tracking_bpf__destroy(tracker->skel);
+    free(tracker);
+}
+
+static void on_registration(struct event_loop *loop, struct loop_source *src) {
+    handle_registration(loop, src->fd);
+}
+
+static void on_taskstats(struct event_loop *loop, struct loop_source *src) {
+    taskstats_drain();
+}
+
+// A watched or trigger process is gone: start its teardown now, ahead of
+// whatever is still queued.
+static void on_watch(struct event_loop *loop, struct loop_source *src) {
+    processWatchReady();
+}
+
+static void on_tick(struct event_loop *loop, struct loop_source *src) {
+    loop_timer_read(src);
+    taskstats_grow(loop, src->ctx);
+    stats_publish(1);
+}
+
+/**
+ * The eBPF counterpart of message_loop: same termination and sampling
+ * rules, but we only wake up for events from tracked processes.
+ */
+int ebpf_message_loop(struct ebpf_tracker *tracker, int ctl_sock) {
+    const long interval = 10*1000;
+    __u64 last_dropped = 0;
+    int result;
+    struct event_loop loop;
+    struct loop_source rb_src = {ring_buffer__epoll_fd(tracker->rb), NULL, NULL};
+    struct loop_source ctl_src = {ctl_sock, on_registration, NULL};
+    struct loop_source taskstats_src = {taskstats_fd(), on_taskstats, NULL};
+    struct loop_source watch_src = {processWatchFd(), on_watch, NULL};
+    struct loop_source tick_src = {-1, on_tick, &taskstats_src};
+
+    if ((result = loop_init(&loop)) < 0) {
+        return result;
+    }
+    if (((result = loop_add(&loop, &rb_src)) < 0)
+            || ((ctl_sock >= 0) && ((result = loop_add(&loop, &ctl_src)) < 0))
+            || ((taskstats_src.fd >= 0) && ((result = loop_add(&loop, &taskstats_src)) < 0))
+            || ((watch_src.fd >= 0) && ((result = loop_add(&loop, &watch_src)) < 0))
+            || ((result = loop_add_timer(&loop, &tick_src, interval)) < 0)) {
+        goto cleanup;
+    }
+
+    while (!loop.stop) {
+        // Exit accounting is sent before the exit event; take it first.
+        taskstats_drain();
+        int count = ring_buffer__consume(tracker->rb);
+        if (count < 0) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Recovering from ring buffer error: %s\n", strerror(-count));
+        }
+
+        __u64 dropped = tracker->skel->bss->dropped;
+        if (dropped != last_dropped) {
+            log_async(LOG_CAT_OVERFLOW, LOG_ERR, "OVERFLOW (eBPF ring buffer full; %llu events lost)",
+                (unsigned long long)(dropped - last_dropped));
+            last_dropped = dropped;
+            __atomic_store_n(&g_loop_stats.ring_drops, dropped, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&g_loop_stats.resyncs, 1, __ATOMIC_RELAXED);
+            proc_resync();
+        }
+
+        if (ctl_sock >= 0) {
+            reap_trees();
+        } else if (is_done() && (count <= 0)) {
+            break;
+        }
+        if (count > 0) {
+            continue;
+        }
+
+        // Wake up in time to move stopping trees along, to publish what
+        // the last events changed, and for the next usage pass.
+        int timeout = loop_earliest(processTeardown(), stats_publish(0));
+        loop_wait(&loop, loop_earliest(timeout, usage_step()));
+        seed_registered();
+    }
+
+cleanup:
+    if (tick_src.fd >= 0) {
+        close(tick_src.fd);
+    }
+    loop_destroy(&loop);
+    return result;
+}
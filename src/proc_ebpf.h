@@ -0,0 +1,14 @@
+
+// eBPF event backend: an alternative to the proc connector that only
+// delivers events for tracked processes.
+
+#ifndef __PROC_EBPF_H
+#define __PROC_EBPF_H
+
+struct ebpf_tracker;
+
+struct ebpf_tracker *ebpf_open();
+int ebpf_message_loop(struct ebpf_tracker *, int);
+void ebpf_close(struct ebpf_tracker *);
+
+#endif
@@ -0,0 +1,22 @@
+
+// Records shared between proc_tracking.bpf.c and proc_ebpf.c.  Kept free of
+// includes so it can sit next to vmlinux.h in the BPF program.
+
+#ifndef __PROC_EBPF_EVENT_H
+#define __PROC_EBPF_EVENT_H
+
+// Values in the tracked map.
+#define TRACK_MEMBER  0x1   // Part of a tree; children are adopted.
+#define TRACK_TRIGGER 0x2   // Only its exit matters (alt_watched).
+
+#define TRACKING_EVENT_FORK 1
+#define TRACKING_EVENT_EXIT 2
+
+struct tracking_event {
+    __u64 timestamp_ns;
+    __u32 what;
+    __u32 parent_tgid;
+    __u32 tgid;
+};
+
+#endif
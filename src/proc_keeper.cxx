@@ -3,6 +3,9 @@
 
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
 #ifdef HAVE_UNORDERED_MAP
 #include <unordered_map>
@@ -12,24 +15,32 @@
 #include <ext/hash_set>
 #endif
 
+#include <algorithm>
 #include <list>
+#include <vector>
+#include <time.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <syslog.h>
 #include <string>
-#include <sstream>
 
 #include "proc_keeper.h"
+#include "proc_scan.h"
+#include "proc_table.h"
+#include "proc_cgroup.h"
+#include "proc_taskstats.h"
+#include "proc_latency.h"
+#include "proc_log.h"
 
 #pragma GCC visibility push(hidden)
 
 #ifdef HAVE_UNORDERED_MAP
 typedef std::unordered_map<pid_t, std::list<pid_t>, std::hash<pid_t>, std::equal_to<pid_t> > PidListMap;
-typedef std::unordered_map<pid_t, pid_t, std::hash<pid_t>, std::equal_to<pid_t> > PidPidMap;
-typedef std::unordered_map<pid_t, unsigned long, std::hash<pid_t>, std::equal_to<pid_t> > PidLUMap;
 typedef std::unordered_set<pid_t, std::hash<pid_t>, std::equal_to<pid_t> > PidSet;
+class ProcessTree;
+typedef std::unordered_multimap<pid_t, ProcessTree*, std::hash<pid_t>, std::equal_to<pid_t> > PidTreeMap;
 #else
 
 struct eqpid {
@@ -39,267 +50,1316 @@ struct eqpid {
 };
 
 typedef __gnu_cxx::hash_map<pid_t, std::list<pid_t>, __gnu_cxx::hash<pid_t>, eqpid> PidListMap;
-typedef __gnu_cxx::hash_map<pid_t, pid_t, __gnu_cxx::hash<pid_t>, eqpid> PidPidMap;
-typedef __gnu_cxx::hash_map<pid_t, unsigned long, __gnu_cxx::hash<pid_t>, eqpid> PidLUMap;
 typedef __gnu_cxx::hash_set<pid_t, __gnu_cxx::hash<pid_t>, eqpid> PidSet;
+class ProcessTree;
+typedef __gnu_cxx::hash_multimap<pid_t, ProcessTree*, __gnu_cxx::hash<pid_t>, eqpid> PidTreeMap;
 #endif
 
 typedef std::list<pid_t> PidList;
+typedef std::list<ProcessTree*> TreeList;
+typedef std::vector<ProcessTree*> TreeVector;
 
-void
-measure_cpu(pid_t pid, unsigned long &utime, unsigned long &stime) {
-    utime = 0;
-    stime = 0;
-    std::stringstream ss;
-    ss << "/proc/" << pid << "/stat";
-    FILE *file = fopen(ss.str().c_str(), "r");
-    if (!file) return;
-    unsigned long tmp_utime, tmp_stime;
-    int ret = fscanf(file, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
-        &tmp_utime, &tmp_stime);
-    fclose(file);
-    if (ret == 2) {
-        utime = tmp_utime;
-        stime = tmp_stime;
+// Per-pid state kept by a tree.  Children of a process are a doubly linked
+// sibling list, so both fork and exit are O(1).
+struct PidRecord {
+    pid_t parent;        // 1 once the parent exits and we are reparented
+    pid_t first_child;
+    pid_t next_sibling;
+    pid_t prev_sibling;
+    unsigned int flags;
+    int stat_fd;         // open /proc/<pid>/stat, if PROC_STAT_FD
+    unsigned long utime; // last sampled CPU time, in ticks
+    unsigned long stime;
+    unsigned int idle;   // samples in a row without CPU use
+    unsigned int due;    // the usage pass in which to sample next
+};
+
+#define PROC_WATCHED 0x1
+#define PROC_STAT_FD 0x2
+
+/*
+ * Sampling keeps /proc/<pid>/stat open for each tracked pid once it has
+ * been sampled, as long as that leaves STAT_FD_RESERVE fds for everything
+ * else; past that, pids are opened afresh for every sample.
+ */
+#define STAT_FD_RESERVE 64
+static unsigned int gStatFds = 0;
+
+static bool stat_fd_available() {
+    static rlim_t budget = 0;
+    if (!budget) {
+        struct rlimit rl;
+        budget = (getrlimit(RLIMIT_NOFILE, &rl) == 0) ? rl.rlim_cur : 1024;
+        budget = (budget > 2*STAT_FD_RESERVE) ? budget - STAT_FD_RESERVE : STAT_FD_RESERVE;
     }
+    return gStatFds < budget;
 }
 
+static void stat_close(PidRecord *rec) {
+    if (rec->flags & PROC_STAT_FD) {
+        close(rec->stat_fd);
+        rec->flags &= ~PROC_STAT_FD;
+        gStatFds--;
+    }
+}
+
+// Returns 0 with utime and stime in ticks, or -errno.
+static int sample_cpu(pid_t pid, PidRecord *rec, unsigned long &utime, unsigned long &stime) {
+    if (rec->flags & PROC_STAT_FD) {
+        int result = stat_read_cpu(rec->stat_fd, &utime, &stime);
+        if (result == -ESRCH) {
+            // Dead, and its exit event not processed yet; the pid may
+            // already belong to someone else.
+            stat_close(rec);
+        }
+        return result;
+    }
+    int fd = stat_open(pid);
+    if (fd < 0) {
+        return fd;
+    }
+    int result = stat_read_cpu(fd, &utime, &stime);
+    if ((result == 0) && stat_fd_available()) {
+        rec->stat_fd = fd;
+        rec->flags |= PROC_STAT_FD;
+        gStatFds++;
+    } else {
+        close(fd);
+    }
+    return result;
+}
+
+static unsigned long long ticks_to_usec(unsigned long ticks) {
+    static long hz = 0;
+    if (!hz) {
+        hz = sysconf(_SC_CLK_TCK);
+    }
+    return (unsigned long long)ticks * 1000000 / hz;
+}
+
+/*
+ * pid_max, as read by the monitor at startup.  Tables grow past it if the
+ * administrator raises pid_max later.
+ */
+pid_t gMaxPid = 32768;
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/*
+ * pidfds for the watched and trigger pid of every tree, all in one epoll
+ * set per tracker, which the event loop polls through processWatchFd.  A pidfd becomes
+ * readable as soon as its process is gone, however far behind the exit
+ * event is in the kernel queue, or if it was lost altogether.
+ */
+static int watch_epoll(int &epoll) {
+    if ((epoll < 0) && ((epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)) {
+        syslog(LOG_ERR, "Unable to create epoll instance for pidfds: %d %s\n", errno, strerror(errno));
+    }
+    return epoll;
+}
+
+// Returns the pidfd, or -1 if there is none; the exit event still works.
+static int watch_open(int &epoll, pid_t pid) {
+    if (watch_epoll(epoll) < 0) {
+        return -1;
+    }
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd == -1) {
+        if (errno != ESRCH) {
+            log_async(LOG_CAT_ERROR, LOG_DEBUG, "Unable to open pidfd for %d: %d %s\n", pid, errno, strerror(errno));
+        }
+        return -1;
+    }
+    // One-shot: the pid's trees close the fd once they have seen it.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = pid;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to watch pidfd for %d: %d %s\n", pid, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void watch_close(int &fd) {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+/*
+ * Teardown stops the whole tree before killing it, so that nothing forks
+ * faster than we can kill.  A process that is stopped cannot fork, but
+ * children it forked just before may still be on their way to us; once a
+ * settle interval passes with no new member showing up the tree is
+ * complete and is killed in a single pass.  A tree that will not stop
+ * (e.g. SIGSTOP is refused) is killed after TEARDOWN_MAX_ROUNDS anyway.
+ */
+#define TEARDOWN_SETTLE_MS 2
+#define TEARDOWN_MAX_ROUNDS 50
+
+enum teardown_state {
+    TEARDOWN_NONE,
+    TEARDOWN_STOPPING,
+    TEARDOWN_KILLING,
+};
+
+static long ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static uint64_t ns_since(uint64_t start) {
+    uint64_t now = now_ns();
+    return (now > start) ? now - start : 0;
+}
+
+/*
+ * Usage is sampled in passes that each get a share of a CPU budget: the
+ * budget times the interval since the last pass.  A pass first samples the
+ * pids that forked or used CPU since they were last looked at, then the
+ * idle ones that are due; pids left when the share is spent stay due for
+ * the next pass.  An idle pid is looked at every 2^idle passes, up to
+ * 2^USAGE_IDLE_SHIFT_MAX.
+ *
+ * The interval widens while passes run out of budget or find nothing busy,
+ * and narrows while they find busy pids and use under a quarter of their
+ * share.  A fork brings it back to USAGE_INTERVAL_FORK_MS at most.  Once
+ * taskstats accounts exits exactly, samples only keep the CPU of live
+ * processes current, and the interval never drops below
+ * USAGE_INTERVAL_EXACT_MS.
+ */
+#define USAGE_INTERVAL_MIN_MS 1000
+#define USAGE_INTERVAL_EXACT_MS 30000
+#define USAGE_INTERVAL_MAX_MS 60000
+#define USAGE_INTERVAL_FORK_MS 10000
+#define USAGE_BUDGET_DEFAULT 0.5        // percent of one CPU
+#define USAGE_IDLE_SHIFT_MAX 5
+#define USAGE_CLOCK_EVERY 16            // samples between budget checks
+
+static uint64_t thread_cpu_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+struct usage_pass {
+    unsigned int number;
+    uint64_t deadline;              // thread CPU time at which to stop
+    unsigned int unchecked;         // samples since the deadline was checked
+    bool spent;
+    unsigned long long sampled, busy, deferred, resting;
+};
+
 class ProcessTree {
 
 public:
-    ProcessTree(pid_t watched, pid_t watched2) : 
+    ProcessTree(int &watch_epoll, pid_t watched, pid_t watched2, int lock_fd, const char *lockfile, const char *cgroup) : 
+        m_procs(gMaxPid),
         m_watched(watched),
         m_alt_watched(watched2),
         m_live_procs(1),
-        m_started_shooting(false),
+        m_teardown(TEARDOWN_NONE),
+        m_teardown_ns(0),
+        m_stop_rounds(0),
+        m_new_members(0),
+        m_cgroup_killed(false),
+        m_live_utime(0),
+        m_live_stime(0),
         m_dead_utime(0),
-        m_dead_stime(0)
+        m_dead_stime(0),
+        m_exact_exits(0),
+        m_peak_rss_kb(0),
+        m_read_bytes(0),
+        m_write_bytes(0),
+        m_lock_fd(lock_fd),
+        m_lockfile(lockfile ? lockfile : ""),
+        m_cgroup(cgroup ? cgroup : ""),
+        m_watched_fd(watch_open(watch_epoll, watched)),
+        m_alt_watched_fd(watch_open(watch_epoll, watched2))
     {
-        syslog(LOG_NOTICE, "glexec.mon[%d:%d]: Started, target uid %d\n", getpid(), watched2, watched);
+        PidRecord *rec = m_procs.insert(watched);
+        if (rec) {
+            rec->flags = PROC_WATCHED;
+        }
+        log_async(LOG_CAT_TREE, LOG_NOTICE, "glexec.mon[%d:%d]: Started, target uid %d\n", getpid(), watched2, watched);
     }
+    ~ProcessTree();
     int fork(pid_t, pid_t);
-    void usage();
-    int exit(pid_t);
-    int shoot_tree();
+    void usage(struct usage_pass &, bool busy_only);
+    int exit(pid_t, const struct exit_stats *, uint64_t exited_ns);
+    void watch_exited(pid_t);
+    void shoot_tree(uint64_t exited_ns);
+    int teardown_step();
+    inline void finish_teardown() {if (m_teardown == TEARDOWN_STOPPING) kill_tree();}
     void get_usage(long unsigned &utime, long unsigned &stime);
+    void get_usage_usec(unsigned long long &utime, unsigned long long &stime);
+    void log_usage();
     inline int is_done();
     inline pid_t get_pid() {return m_watched;}
+    inline pid_t get_alt_pid() {return m_alt_watched;}
+    inline unsigned int live_procs() {return m_live_procs;}
+    inline bool in_teardown() {return m_teardown != TEARDOWN_NONE;}
+    inline enum teardown_state teardown_state() {return m_teardown;}
+    inline pid_t next_member(pid_t pid) {return m_procs.next(pid);}
+    inline size_t footprint() {return sizeof(*this) + m_procs.footprint();}
 
 private:
-    PidSet m_ignored_pids;
-    PidListMap m_pid_map;
-    PidPidMap m_pid_reverse;
+    PidTable<PidRecord> m_procs;
     pid_t m_watched;
     pid_t m_alt_watched;
     unsigned int m_live_procs;
-    bool m_started_shooting;
-    inline int record_new(pid_t, pid_t);
-    PidLUMap m_utime, m_stime;
-    long unsigned m_dead_utime, m_dead_stime;
+    enum teardown_state m_teardown;
+    uint64_t m_teardown_ns;         // when the head exited, as the kernel saw it
+    struct timespec m_round_ts;     // when the current stop round began
+    unsigned int m_stop_rounds;
+    unsigned int m_new_members;     // forked since the current stop round began
+    bool m_cgroup_killed;
+    inline void detach(PidRecord *);
+    int signal_tree(int sig);
+    void kill_tree();
+    // CPU usage is kept as running totals, so get_usage is O(1): the sum
+    // of the last samples of live members, in ticks, and the CPU of
+    // exited ones, in microseconds.
+    unsigned long m_live_utime, m_live_stime;
+    unsigned long long m_dead_utime, m_dead_stime;
+    inline void retire_sample(PidRecord *);
+    // Exits accounted from taskstats rather than from the last sample.
+    unsigned int m_exact_exits;
+    unsigned long long m_peak_rss_kb, m_read_bytes, m_write_bytes;
+    int m_lock_fd;
+    std::string m_lockfile;
+    // If set, the payload runs in its own cgroup: killing and accounting go
+    // through it, and the pid records only decide when we are done.
+    std::string m_cgroup;
+    int m_watched_fd, m_alt_watched_fd; // pidfds, or -1
 };
 
+ProcessTree::~ProcessTree() {
+    watch_close(m_watched_fd);
+    watch_close(m_alt_watched_fd);
+    pid_t pid;
+    for (pid = m_procs.next(0); pid; pid = m_procs.next(pid)) {
+        stat_close(m_procs.find(pid));
+    }
+    // Release the pool account handed to us by a daemon registration.
+    if (!m_lockfile.empty()) {
+        log_async(LOG_CAT_TREE, LOG_DEBUG, "Removing pool account lockfile %s.\n", m_lockfile.c_str());
+        if (unlink(m_lockfile.c_str()) == -1) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to remove lockfile %s (errno=%d, %s).\n", m_lockfile.c_str(), errno, strerror(errno));
+        }
+    }
+    if (m_lock_fd >= 0) {
+        close(m_lock_fd);
+    }
+    if (!m_cgroup.empty()) {
+        cgroup_remove(m_cgroup.c_str());
+    }
+}
+
 inline int ProcessTree::is_done() {
     return !m_live_procs;
 }
 
-inline int ProcessTree::record_new(pid_t parent_pid, pid_t child_pid) {
-    //syslog(LOG_DEBUG, "FORK %d -> %d\n", parent_pid, child_pid);
-    m_live_procs++;
-    PidList pl;
-    pl.push_back(child_pid);
-    m_pid_map[parent_pid] = pl;
-    m_pid_reverse[child_pid] = parent_pid;
-    return 0;
+// Remove a record from its parent's list of children.
+inline void ProcessTree::detach(PidRecord *rec) {
+    PidRecord *sibling;
+    if (rec->prev_sibling) {
+        if ((sibling = m_procs.find(rec->prev_sibling))) {
+            sibling->next_sibling = rec->next_sibling;
+        }
+    } else if (rec->parent) {
+        PidRecord *parent = m_procs.find(rec->parent);
+        if (parent) {
+            parent->first_child = rec->next_sibling;
+        }
+    }
+    if (rec->next_sibling && (sibling = m_procs.find(rec->next_sibling))) {
+        sibling->prev_sibling = rec->prev_sibling;
+    }
+    rec->next_sibling = rec->prev_sibling = 0;
 }
 
+/*
+ * Returns 1 if the child was adopted into the tree, 0 otherwise.  Unrelated
+ * pids never reach us; they are filtered out by the index in processFork.
+ *
+ * Idempotent: a /proc seed or resync may adopt a child before its fork
+ * event comes out of the queue.
+ */
 int ProcessTree::fork(pid_t parent_pid, pid_t child_pid) {
-    PidListMap::iterator it;
-    PidPidMap::const_iterator it2;
-    if (m_ignored_pids.find(parent_pid) != m_ignored_pids.end()) {
+    PidRecord *parent, *child;
+    if ((parent_pid == 1) || m_procs.find(child_pid) || !(parent = m_procs.find(parent_pid))) {
         return 0;
-    } else if ((parent_pid != 1) && (it = m_pid_map.find(parent_pid)) != m_pid_map.end()) {
-        //syslog(LOG_DEBUG, "FORK %d -> %d\n", parent_pid, child_pid);
-        m_live_procs++;
-        (it->second).push_back(child_pid);
-        m_pid_reverse[child_pid] = parent_pid;
-        if (m_started_shooting) {
-            shoot_tree();
-        }
-    } else if ((it2 = m_pid_reverse.find(parent_pid)) != m_pid_reverse.end()) {
-        record_new(parent_pid, child_pid);
-        if (m_started_shooting) {
-            shoot_tree();
-        }
-    } else if (parent_pid == m_watched) {
-        record_new(parent_pid, child_pid);
-    } else {
-        m_ignored_pids.insert(parent_pid);
-        m_ignored_pids.insert(child_pid);
     }
-    return 0;
+    //syslog(LOG_DEBUG, "FORK %d -> %d\n", parent_pid, child_pid);
+    if (!(child = m_procs.insert(child_pid))) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to allocate a record for pid %d.\n", child_pid);
+        return 0;
+    }
+    child->parent = parent_pid;
+    child->next_sibling = parent->first_child;
+    if (parent->first_child) {
+        m_procs.find(parent->first_child)->prev_sibling = child_pid;
+    }
+    parent->first_child = child_pid;
+    m_live_procs++;
+    // Late arrivals are dealt with one by one; cgroup.kill already caught
+    // children forked while it ran.
+    if (m_teardown == TEARDOWN_STOPPING) {
+        if ((::kill(child_pid, SIGSTOP) == -1) && (errno != ESRCH)) {
+            log_async(LOG_CAT_SIGNAL, LOG_ERR, "FAILURE TO STOP %d: %d %s\n", child_pid, errno, strerror(errno));
+        }
+        m_new_members++;
+    } else if ((m_teardown == TEARDOWN_KILLING) && !m_cgroup_killed) {
+        if ((::kill(child_pid, SIGKILL) == -1) && (errno != ESRCH)) {
+            log_async(LOG_CAT_SIGNAL, LOG_ERR, "FAILURE TO KILL %d: %d %s\n", child_pid, errno, strerror(errno));
+        }
+    }
+    return 1;
 }
 
-void ProcessTree::usage() {
-    PidPidMap::const_iterator it;
-    for (it = m_pid_reverse.begin(); it != m_pid_reverse.end(); ++it) {
-        pid_t pid = it->first;
-        long unsigned utime, stime;
-
-        measure_cpu(pid, utime, stime);
-
-        PidLUMap::const_iterator it2 = m_utime.find(pid);
-        if (it2 == m_utime.end()) {
-            m_utime[pid] = utime;
-        } else {
-            if (it2->second > utime) {
-                m_dead_utime += it2->second;
-                m_utime[pid] += utime;
-            } else {
-                m_utime[pid] = utime;
+/*
+ * Sample the members due in this pass, or with busy_only just those not
+ * known to be idle.  Once the pass has spent its budget, members still due
+ * are only counted.
+ */
+void ProcessTree::usage(struct usage_pass &pass, bool busy_only) {
+    if (!m_cgroup.empty()) {
+        return;
+    }
+    pid_t pid;
+    for (pid = m_procs.next(0); pid; pid = m_procs.next(pid)) {
+        PidRecord *rec = m_procs.find(pid);
+        if (rec->flags & PROC_WATCHED) {
+            continue;
+        }
+        if (rec->due > pass.number) {
+            // Busy members not due were sampled in the first sweep.
+            if (!busy_only && rec->idle) {
+                pass.resting++;
             }
+            continue;
         }
-        it2 = m_stime.find(pid);
-        if (it2 == m_stime.end()) {
-            m_stime[pid] = stime;
-        } else {
-            if (it2->second > stime) {
-                m_dead_stime += it2->second;
-                m_stime[pid] = stime;
-            } else {
-                m_stime[pid] = stime;
+        if (busy_only && rec->idle) {
+            continue;
+        }
+        if (!pass.spent && (++pass.unchecked >= USAGE_CLOCK_EVERY)) {
+            pass.unchecked = 0;
+            pass.spent = thread_cpu_ns() >= pass.deadline;
+        }
+        if (pass.spent) {
+            if (!busy_only) {
+                pass.deferred++;
+            }
+            continue;
+        }
+        pass.sampled++;
+        long unsigned utime, stime;
+        bool busy = false;
+        if (sample_cpu(pid, rec, utime, stime) == 0) {
+            // A smaller value means the pid was reused behind our back
+            // (only possible for pids sampled without a persistent fd):
+            // the last sample is all the old process will be charged for.
+            if ((rec->utime > utime) || (rec->stime > stime)) {
+                retire_sample(rec);
             }
+            busy = (utime != rec->utime) || (stime != rec->stime);
+            m_live_utime += utime - rec->utime;
+            m_live_stime += stime - rec->stime;
+            rec->utime = utime;
+            rec->stime = stime;
         }
+        if (busy) {
+            pass.busy++;
+            rec->idle = 0;
+        } else if (rec->idle < USAGE_IDLE_SHIFT_MAX) {
+            rec->idle++;
+        }
+        rec->due = pass.number + (1U << rec->idle);
     }
 }
 
+// Move the last sample of a process from the live to the dead totals.
+inline void ProcessTree::retire_sample(PidRecord *rec) {
+    m_live_utime -= rec->utime;
+    m_live_stime -= rec->stime;
+    m_dead_utime += ticks_to_usec(rec->utime);
+    m_dead_stime += ticks_to_usec(rec->stime);
+    rec->utime = rec->stime = 0;
+}
+
+void ProcessTree::get_usage_usec(unsigned long long &utime, unsigned long long &stime) {
+    struct cgroup_usage cg_usage;
+    if (!m_cgroup.empty() && (cgroup_read_usage(m_cgroup.c_str(), &cg_usage) == 0)) {
+        utime = cg_usage.user_usec;
+        stime = cg_usage.system_usec;
+        return;
+    }
+    utime = m_dead_utime + ticks_to_usec(m_live_utime);
+    stime = m_dead_stime + ticks_to_usec(m_live_stime);
+}
+
 void ProcessTree::get_usage(unsigned long &utime, unsigned long &stime) {
-    utime = m_dead_utime;
-    stime = m_dead_stime;
-    PidLUMap::const_iterator it;
-    for (it = m_utime.begin(); it != m_utime.end(); ++it) {
-        utime += it->second;
+    unsigned long long utime_usec, stime_usec;
+    get_usage_usec(utime_usec, stime_usec);
+    utime = utime_usec / 1000000;
+    stime = stime_usec / 1000000;
+}
+
+// Only called once the tree is empty: by then every member's exit has been
+// accounted for, and the cgroup has been charged for all they used.
+void ProcessTree::log_usage() {
+    struct cgroup_usage cg_usage;
+    if (!m_cgroup.empty() && (cgroup_read_usage(m_cgroup.c_str(), &cg_usage) == 0)) {
+        log_async(LOG_CAT_TREE, LOG_NOTICE, "glexec.mon[%d#%d]: Terminated, CPU user %llu system %llu, memory peak %llu KiB, IO read %llu write %llu",
+            getpid(), m_alt_watched, cg_usage.user_usec / 1000000, cg_usage.system_usec / 1000000,
+            cg_usage.memory_peak / 1024, cg_usage.io_rbytes, cg_usage.io_wbytes);
+        return;
     }
-    for (it = m_stime.begin(); it != m_stime.end(); ++it) {
-        stime += it->second;
+    long unsigned utime, stime;
+    get_usage(utime, stime);
+    if (m_exact_exits) {
+        log_async(LOG_CAT_TREE, LOG_NOTICE, "glexec.mon[%d#%d]: Terminated, CPU user %lu system %lu, max RSS %llu KiB, IO read %llu write %llu",
+            getpid(), m_alt_watched, utime, stime, m_peak_rss_kb, m_read_bytes, m_write_bytes);
+    } else {
+        log_async(LOG_CAT_TREE, LOG_NOTICE, "glexec.mon[%d#%d]: Terminated, CPU user %lu system %lu", getpid(), m_alt_watched, utime, stime);
     }
-    long hz = sysconf(_SC_CLK_TCK);
-    utime /= hz;
-    stime /= hz;
 }
 
-int ProcessTree::shoot_tree() {
-    m_started_shooting = true;
 
-    // Kill it all.
-    PidPidMap::const_iterator it;
-    // Check to see if there's children of this process.
+
+// Send sig to every member but the watched process.
+int ProcessTree::signal_tree(int sig) {
+    pid_t pid;
     int body_count = 0;
-    for (it = m_pid_reverse.begin(); it != m_pid_reverse.end(); ++it) {
-        if (it->first == 1)
+    for (pid = m_procs.next(0); pid; pid = m_procs.next(pid)) {
+        if ((pid == 1) || (m_procs.find(pid)->flags & PROC_WATCHED))
             continue;
-        if ((kill(it->first, SIGKILL) == -1) && (errno != ESRCH)) {
-            syslog(LOG_ERR, "FAILURE TO KILL %d: %d %s\n", it->first, errno, strerror(errno));
+        if ((::kill(pid, sig) == -1) && (errno != ESRCH)) {
+            log_async(LOG_CAT_SIGNAL, LOG_ERR, "FAILURE TO %s %d: %d %s\n", (sig == SIGKILL) ? "KILL" : "STOP", pid, errno, strerror(errno));
         }
         body_count ++;
     }
+    return body_count;
+}
+
+/*
+ * Begin tearing the tree down.  With a cgroup the kernel does it all in
+ * one write; otherwise the tree is stopped here and killed by
+ * teardown_step once it has stopped growing.
+ *
+ * exited_ns is the kernel's CLOCK_MONOTONIC timestamp of the head's exit,
+ * so the teardown latencies include any time the event spent queued, or 0
+ * if there is none.
+ */
+void ProcessTree::shoot_tree(uint64_t exited_ns) {
+    if (m_teardown != TEARDOWN_NONE) {
+        return;
+    }
+    m_teardown_ns = exited_ns ? exited_ns : now_ns();
+
+    if (!m_cgroup.empty() && (cgroup_kill(m_cgroup.c_str()) == 0)) {
+        latency_record(&g_latency.kill, ns_since(m_teardown_ns));
+        m_teardown = TEARDOWN_KILLING;
+        m_cgroup_killed = true;
+        return;
+    }
+
+    m_teardown = TEARDOWN_STOPPING;
+    clock_gettime(CLOCK_MONOTONIC, &m_round_ts);
+    m_new_members = 0;
+    signal_tree(SIGSTOP);
+}
+
+/*
+ * Returns the milliseconds until the tree needs another step, or -1 if it
+ * is not being stopped.
+ */
+int ProcessTree::teardown_step() {
+    if (m_teardown != TEARDOWN_STOPPING) {
+        return -1;
+    }
+    long elapsed = ms_since(&m_round_ts);
+    if (elapsed < TEARDOWN_SETTLE_MS) {
+        return TEARDOWN_SETTLE_MS - elapsed;
+    }
+    if (m_new_members && (m_stop_rounds < TEARDOWN_MAX_ROUNDS)) {
+        m_stop_rounds++;
+        m_new_members = 0;
+        clock_gettime(CLOCK_MONOTONIC, &m_round_ts);
+        return TEARDOWN_SETTLE_MS;
+    }
+    kill_tree();
+    return -1;
+}
+
+// Kill everything that is left in one pass.
+void ProcessTree::kill_tree() {
+    m_teardown = TEARDOWN_KILLING;
+    latency_record(&g_latency.kill, ns_since(m_teardown_ns));
+    int body_count = signal_tree(SIGKILL);
     if (body_count) {
-        syslog(LOG_DEBUG, "Cleaned all processes associated with %d\n", m_watched);
+        log_async(LOG_CAT_TREE, LOG_DEBUG, "Cleaned all %d processes associated with %d after %u stop rounds\n", body_count, m_watched, m_stop_rounds);
     }
-    long unsigned utime, stime;
-    get_usage(utime, stime);
-    syslog(LOG_NOTICE, "glexec.mon[%d#%d]: Terminated, CPU user %lu system %lu", getpid(), m_alt_watched, utime, stime);
-    return body_count;
 }
 
-int ProcessTree::exit(pid_t pid) {
-    PidListMap::iterator it;
-    PidPidMap::iterator it2;
+/*
+ * stats, if taskstats reported the exit, replaces the last sample of the
+ * process in the totals.  exited_ns is when the kernel reported the exit.
+ */
+int ProcessTree::exit(pid_t pid, const struct exit_stats *stats, uint64_t exited_ns) {
     // The head or watched process has died.  Start shooting
     if (pid == m_alt_watched) {
-        shoot_tree();
-        syslog(LOG_DEBUG, "EXIT %d (trigger process)\n", pid);
+        watch_close(m_alt_watched_fd);
+        shoot_tree(exited_ns);
+        log_async(LOG_CAT_TREE, LOG_DEBUG, "EXIT %d (trigger process)\n", pid);
     }
     if (pid == m_watched) {
-        shoot_tree();
-        syslog(LOG_DEBUG, "EXIT %d (watched process)\n", pid);
-        m_live_procs--;
+        watch_close(m_watched_fd);
+        shoot_tree(exited_ns);
+        log_async(LOG_CAT_TREE, LOG_DEBUG, "EXIT %d (watched process)\n", pid);
     }
-    if (m_ignored_pids.find(pid) != m_ignored_pids.end()) {
-        m_ignored_pids.erase(pid);
+    PidRecord *rec = m_procs.find(pid);
+    if (!rec) {
         return 0;
     }
-    int in_pid_map = false;
-    if ((it = m_pid_map.find(pid)) != m_pid_map.end()) {
-        in_pid_map = true;
-        PidList::const_iterator it3;
-        PidList &pl = it->second;
-        // Check to see if there's children of this process.
-        for (it3 = pl.begin(); it3 != pl.end(); ++it3) {
-             // Re-parent the process to init.
-             const pid_t child_pid = *it3;
-             if ((it2 = m_pid_reverse.find(child_pid)) != m_pid_reverse.end()) {
-                 //syslog(LOG_DEBUG, "DAEMON %d\n", child_pid);
-                 it2->second = 1;
-             }
-        }
-        m_pid_map.erase(pid);
-    }
-    if ((it2 = m_pid_reverse.find(pid)) == m_pid_reverse.end()) {
-        if (in_pid_map) {
-            //syslog(LOG_DEBUG, "EXIT %d\n", pid);
-            if (pid != m_watched) {
-                m_live_procs--;
-            }
+    // Re-parent any children to init; they stay in the tree.
+    pid_t child_pid = rec->first_child;
+    while (child_pid) {
+        PidRecord *child = m_procs.find(child_pid);
+        //syslog(LOG_DEBUG, "DAEMON %d\n", child_pid);
+        child_pid = child->next_sibling;
+        child->parent = 1;
+        child->next_sibling = child->prev_sibling = 0;
+    }
+    //syslog(LOG_DEBUG, "EXIT %d PARENT %d\n", pid, rec->parent);
+    detach(rec);
+    // Keep the CPU time of dead processes in the total.  As when sampling,
+    // the watched process itself is not counted.
+    if (rec->flags & PROC_WATCHED) {
+        // Nothing to add.
+    } else if (stats) {
+        m_live_utime -= rec->utime;
+        m_live_stime -= rec->stime;
+        m_dead_utime += stats->utime_usec;
+        m_dead_stime += stats->stime_usec;
+        if (stats->rss_kb > m_peak_rss_kb) {
+            m_peak_rss_kb = stats->rss_kb;
         }
+        m_read_bytes += stats->read_bytes;
+        m_write_bytes += stats->write_bytes;
+        m_exact_exits++;
     } else {
-        pid_t parent = it2->second;
-        //syslog(LOG_DEBUG, "EXIT %d PARENT %d\n", pid, parent);
-        if ((it = m_pid_map.find(parent)) != m_pid_map.end()) {
-            (it->second).remove(pid);
-        }
-        m_pid_reverse.erase(pid);
-        if (pid != m_watched) {
-            m_live_procs--;
+        retire_sample(rec);
+    }
+    stat_close(rec);
+    m_procs.erase(pid);
+    if (!--m_live_procs && (m_teardown != TEARDOWN_NONE)) {
+        if (m_teardown == TEARDOWN_STOPPING) {
+            kill_tree();
         }
+        latency_record(&g_latency.empty, ns_since(m_teardown_ns));
+        // Only now has every member's exit been accounted for.
+        log_usage();
+        log_async(LOG_CAT_TREE, LOG_INFO, "glexec.mon[%d#%d]: Tree empty %ld ms after the head exited\n", getpid(), m_alt_watched, (long)(ns_since(m_teardown_ns) / 1000000));
     }
     return 0;
 }
 
-ProcessTree *gTree;
+/*
+ * The pidfd of the watched or trigger pid says it is gone.  Only the
+ * teardown starts here: the records stay until the exit event comes out of
+ * the queue, behind any fork events that add members to the tree, which
+ * teardown then stops or kills as they are adopted.
+ */
+void ProcessTree::watch_exited(pid_t pid) {
+    if (pid == m_alt_watched) {
+        watch_close(m_alt_watched_fd);
+    }
+    if (pid == m_watched) {
+        watch_close(m_watched_fd);
+    }
+    if (m_teardown == TEARDOWN_NONE) {
+        log_async(LOG_CAT_TREE, LOG_DEBUG, "EXIT %d (seen through its pidfd)\n", pid);
+        // The pidfd is ready within microseconds of the exit.
+        shoot_tree(now_ns());
+    }
+}
 
-int initialize(pid_t watch, pid_t alt_watch) {
-    gTree = new ProcessTree(watch, alt_watch);
+/*
+ * A set of trees we are tracking.  The monitor and the daemon use the
+ * default one, gTracker, through the C API in proc_keeper.h; benchmarks and
+ * stress tests can create more with tracker_create.  In the standalone
+ * monitor there is exactly one tree; in daemon mode there is one per
+ * registered payload.
+ *
+ * m_index maps every pid belonging to a tree (including the watched pid) to
+ * its owner, so each kernel event costs a single array lookup regardless of
+ * how many trees are registered.  A pid may belong to more than one tree when
+ * glexec is nested inside another tracked payload; the extra owners live in
+ * m_shared.  m_triggers holds the trigger (alt_watched) pids, which only
+ * matter for exit events.
+ */
+struct IndexEntry {
+    ProcessTree *tree;
+    unsigned int shared; // further owners in m_shared
+};
+
+class Tracker {
+
+public:
+    Tracker() :
+        m_index(gMaxPid),
+        m_finished(0),
+        m_ignored_forks(0),
+        m_ignored_exits(0),
+        m_exit_stats(gMaxPid),
+        m_watch_epoll(-1),
+        m_poll_usage(false),
+        m_exact_exits(false),
+        m_usage_budget(USAGE_BUDGET_DEFAULT),
+        m_usage_interval(USAGE_INTERVAL_FORK_MS),
+        m_usage_passes(0),
+        m_usage_sampled(0),
+        m_usage_deferred(0),
+        m_usage_resting(0),
+        m_usage_cpu_ns(0),
+        m_track_hook(NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &m_usage_start);
+        m_usage_ts = m_usage_start;
+    }
+    void reserve(pid_t max_pid) {m_index.reserve(max_pid); m_exit_stats.reserve(max_pid);}
+    int register_tree(pid_t, pid_t, int, const char *, const char *);
+    int is_done();
+    int reap_trees();
+    void finalize();
+    int fork(pid_t parent_pid, pid_t child_pid) {return adopt(parent_pid, child_pid, false);}
+    void exit_stats(pid_t, const struct exit_stats *);
+    int exit(pid_t, uint64_t exited_ns);
+    int resync(const struct proc_snapshot *);
+    size_t footprint();
+    void visit(tree_visitor_t, void *);
+    void stats(struct tracker_stats *, bool);
+    int teardown();
+    int watch_fd() {return watch_epoll(m_watch_epoll);}
+    void watch_ready();
+    void usage();
+    int usage_due();
+    void log_usage_sampling();
+    inline unsigned int tracked_pids() {return m_index.size();}
+    inline void set_usage_polling(bool enabled) {m_poll_usage = enabled;}
+    inline void set_exact_exits(bool exact) {m_exact_exits = exact;}
+    inline void set_usage_budget(double percent) {m_usage_budget = percent;}
+    inline void set_track_hook(track_hook_t hook) {m_track_hook = hook;}
+
+private:
+    TreeList m_trees;
+    PidTable<IndexEntry> m_index;
+    PidTreeMap m_shared;
+    PidTreeMap m_triggers;
+    unsigned int m_finished;
+    unsigned long long m_ignored_forks, m_ignored_exits;
+    // Exit accounting from taskstats for tracked pids, waiting for the proc
+    // connector to report the exit.
+    PidTable<struct exit_stats> m_exit_stats;
+    int m_watch_epoll;
+    bool m_poll_usage, m_exact_exits;
+    // Usage sampling: the budget in percent of one CPU, the interval
+    // between passes in ms, and what the passes so far did with it.
+    double m_usage_budget;
+    long m_usage_interval;
+    struct timespec m_usage_start, m_usage_ts;
+    unsigned int m_usage_passes;
+    unsigned long long m_usage_sampled, m_usage_deferred, m_usage_resting;
+    uint64_t m_usage_cpu_ns;
+    track_hook_t m_track_hook;
+    int adopt(pid_t, pid_t, bool);
+    inline long usage_floor() {
+        return (m_exact_exits && !m_poll_usage) ? USAGE_INTERVAL_EXACT_MS : USAGE_INTERVAL_MIN_MS;
+    }
+    void index_insert(pid_t, ProcessTree *);
+    void index_remove(pid_t, ProcessTree *);
+    void index_owners(const IndexEntry *, pid_t, TreeVector &);
+};
+
+static Tracker gTracker;
+
+static void unindex(PidTreeMap &index, ProcessTree *tree) {
+    PidTreeMap::iterator it = index.begin();
+    while (it != index.end()) {
+        if (it->second == tree) {
+            it = index.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Tracker::index_insert(pid_t pid, ProcessTree *tree) {
+    IndexEntry *entry = m_index.insert(pid);
+    if (!entry) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to allocate an index entry for pid %d.\n", pid);
+    } else if (!entry->tree) {
+        entry->tree = tree;
+    } else {
+        m_shared.insert(PidTreeMap::value_type(pid, tree));
+        entry->shared++;
+    }
+}
+
+void Tracker::index_remove(pid_t pid, ProcessTree *tree) {
+    IndexEntry *entry = m_index.find(pid);
+    if (!entry) {
+        return;
+    }
+    if (!entry->shared) {
+        if (entry->tree == tree) {
+            m_index.erase(pid);
+        }
+        return;
+    }
+    std::pair<PidTreeMap::iterator, PidTreeMap::iterator> range = m_shared.equal_range(pid);
+    PidTreeMap::iterator it;
+    for (it = range.first; it != range.second; ++it) {
+        if ((entry->tree == tree) || (it->second == tree)) {
+            if (entry->tree == tree) {
+                entry->tree = it->second;
+            }
+            m_shared.erase(it);
+            entry->shared--;
+            return;
+        }
+    }
+}
+
+// The trees owning pid.  Only nested trees need the vector.
+void Tracker::index_owners(const IndexEntry *entry, pid_t pid, TreeVector &owners) {
+    owners.push_back(entry->tree);
+    std::pair<PidTreeMap::iterator, PidTreeMap::iterator> range = m_shared.equal_range(pid);
+    PidTreeMap::const_iterator it;
+    for (it = range.first; it != range.second; ++it) {
+        owners.push_back(it->second);
+    }
+}
+
+int Tracker::register_tree(pid_t watch, pid_t alt_watch, int lock_fd, const char *lockfile, const char *cgroup) {
+    ProcessTree *tree = new ProcessTree(m_watch_epoll, watch, alt_watch, lock_fd, lockfile, cgroup);
+    m_trees.push_back(tree);
+    index_insert(watch, tree);
+    m_triggers.insert(PidTreeMap::value_type(alt_watch, tree));
+    if (m_track_hook) {
+        m_track_hook(watch, 1);
+        m_track_hook(alt_watch, 0);
+    }
     return 0;
 }
 
-int is_done() {
-    if (gTree) {
-        return gTree->is_done();
+int Tracker::is_done() {
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        if (!(*it)->is_done()) {
+            return 0;
+        }
     }
     return 1;
 }
 
-void finalize() {
-    if (gTree) {
-        if (!is_done()) {
-            syslog(LOG_ERR, "ERROR: Finalizing without finishing killing the pid %d tree.\n", gTree->get_pid());
+int Tracker::reap_trees() {
+    if (!m_finished) {
+        return m_trees.size();
+    }
+    TreeList::iterator it = m_trees.begin();
+    while (it != m_trees.end()) {
+        ProcessTree *tree = *it;
+        if (tree->is_done()) {
+            log_async(LOG_CAT_TREE, LOG_INFO, "Finished tracking pid %d.\n", tree->get_pid());
+            pid_t pid;
+            for (pid = tree->next_member(0); pid; pid = tree->next_member(pid)) {
+                index_remove(pid, tree);
+            }
+            unindex(m_triggers, tree);
+            delete tree;
+            it = m_trees.erase(it);
+        } else {
+            ++it;
         }
-        delete gTree;
     }
-    gTree = NULL;
+    m_finished = 0;
+    return m_trees.size();
+}
+
+void Tracker::finalize() {
+    log_usage_sampling();
+    TreeList::iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        if (!(*it)->is_done()) {
+            syslog(LOG_ERR, "ERROR: Finalizing without finishing killing the pid %d tree.\n", (*it)->get_pid());
+            // Never leave a half-stopped tree behind.
+            (*it)->finish_teardown();
+            (*it)->log_usage();
+        }
+        delete *it;
+    }
+    m_trees.clear();
+    if (m_watch_epoll >= 0) {
+        close(m_watch_epoll);
+        m_watch_epoll = -1;
+    }
+    m_index.clear();
+    m_exit_stats.clear();
+    m_shared.clear();
+    m_triggers.clear();
+    m_finished = 0;
+}
+
+int Tracker::adopt(pid_t parent_pid, pid_t child_pid, bool notify) {
+    IndexEntry *entry = m_index.find(parent_pid);
+    if (!entry) {
+        // Resyncs try every pid in the snapshot; only count kernel forks.
+        if (!notify) {
+            m_ignored_forks++;
+        }
+        return 0;
+    }
+    int adopted = 0;
+    if (!entry->shared) {
+        ProcessTree *tree = entry->tree;
+        if (tree->fork(parent_pid, child_pid)) {
+            index_insert(child_pid, tree);
+            adopted = 1;
+        }
+    } else {
+        // Inserting may rehash m_shared, so collect the owners first.
+        TreeVector owners;
+        index_owners(entry, parent_pid, owners);
+        TreeVector::const_iterator it;
+        for (it = owners.begin(); it != owners.end(); ++it) {
+            if ((*it)->fork(parent_pid, child_pid)) {
+                index_insert(child_pid, *it);
+                adopted++;
+            }
+        }
+    }
+    if (notify && m_track_hook && adopted) {
+        m_track_hook(child_pid, 1);
+    }
+    // The child is sampled first thing in the next pass; do not let that
+    // wait on an interval stretched by idleness.
+    if (adopted && (m_usage_interval > USAGE_INTERVAL_FORK_MS)) {
+        m_usage_interval = std::max((long)USAGE_INTERVAL_FORK_MS, usage_floor());
+    }
+    return adopted;
+}
+
+void Tracker::exit_stats(pid_t pid, const struct exit_stats *stats) {
+    if (!m_index.find(pid)) {
+        return;
+    }
+    // Zeroed when new; the threads of a process add up as they exit.
+    struct exit_stats *entry = m_exit_stats.insert(pid);
+    if (entry) {
+        entry->utime_usec += stats->utime_usec;
+        entry->stime_usec += stats->stime_usec;
+        if (stats->rss_kb > entry->rss_kb) {
+            entry->rss_kb = stats->rss_kb;
+        }
+        entry->read_bytes += stats->read_bytes;
+        entry->write_bytes += stats->write_bytes;
+    }
+}
+
+int Tracker::exit(pid_t pid, uint64_t exited_ns) {
+    std::pair<PidTreeMap::iterator, PidTreeMap::iterator> range = m_triggers.equal_range(pid);
+    PidTreeMap::iterator it;
+    for (it = range.first; it != range.second; ++it) {
+        it->second->exit(pid, NULL, exited_ns);
+    }
+    IndexEntry *entry = m_index.find(pid);
+    if (!entry) {
+        if (range.first == range.second) {
+            m_ignored_exits++;
+        }
+        return 0;
+    }
+    const struct exit_stats *stats = m_exit_stats.find(pid);
+    if (!entry->shared) {
+        entry->tree->exit(pid, stats, exited_ns);
+        if (entry->tree->is_done()) {
+            m_finished++;
+        }
+    } else {
+        TreeVector owners;
+        index_owners(entry, pid, owners);
+        TreeVector::const_iterator it2;
+        for (it2 = owners.begin(); it2 != owners.end(); ++it2) {
+            (*it2)->exit(pid, stats, exited_ns);
+            if ((*it2)->is_done()) {
+                m_finished++;
+            }
+        }
+        m_shared.erase(pid);
+    }
+    if (stats) {
+        m_exit_stats.erase(pid);
+    }
+    m_index.erase(pid);
+    return 0;
+}
+
+/**
+ * Reconcile every tree with a snapshot of the process table, after the
+ * kernel has dropped events.  Tracked pids missing from the snapshot are
+ * processed as exits; live descendants of tracked pids that we never saw
+ * fork are adopted, level by level.  Events still queued behind the
+ * overflow are harmless afterwards: forks are not adopted twice and exits
+ * of unknown pids are ignored.
+ */
+int Tracker::resync(const struct proc_snapshot *snap) {
+    PidSet alive;
+    PidListMap children;
+    unsigned int idx;
+    // Until the plugin's launcher has exited, we are the payload's
+    // grandchild; never adopt ourselves.
+    pid_t self = getpid();
+    for (idx = 0; idx < snap->count; idx++) {
+        alive.insert(snap->pid[idx]);
+        if (snap->pid[idx] != self) {
+            children[snap->ppid[idx]].push_back(snap->pid[idx]);
+        }
+    }
+
+    PidList dead;
+    pid_t pid;
+    for (pid = m_index.next(0); pid; pid = m_index.next(pid)) {
+        if (alive.find(pid) == alive.end()) {
+            dead.push_back(pid);
+        }
+    }
+    PidTreeMap::const_iterator it;
+    for (it = m_triggers.begin(); it != m_triggers.end(); ++it) {
+        if (alive.find(it->first) == alive.end()) {
+            dead.push_back(it->first);
+        }
+    }
+    dead.sort();
+    dead.unique();
+    PidList::const_iterator it2;
+    for (it2 = dead.begin(); it2 != dead.end(); ++it2) {
+        exit(*it2, 0);
+    }
+
+    int changes = dead.size();
+    PidList pending;
+    for (pid = m_index.next(0); pid; pid = m_index.next(pid)) {
+        pending.push_back(pid);
+    }
+    while (!pending.empty()) {
+        pid_t parent = pending.front();
+        pending.pop_front();
+        PidListMap::const_iterator it3 = children.find(parent);
+        if (it3 == children.end()) {
+            continue;
+        }
+        for (it2 = it3->second.begin(); it2 != it3->second.end(); ++it2) {
+            if (adopt(parent, *it2, true)) {
+                changes++;
+                pending.push_back(*it2);
+            }
+        }
+    }
+    return changes;
+}
+
+size_t Tracker::footprint() {
+    size_t bytes = m_index.footprint();
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        bytes += (*it)->footprint();
+    }
+    return bytes;
+}
+
+void Tracker::visit(tree_visitor_t visit, void *ctx) {
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        visit((*it)->get_pid(), (*it)->get_alt_pid(), (*it)->live_procs(), (*it)->in_teardown(), ctx);
+    }
+}
+
+void Tracker::stats(struct tracker_stats *stats, bool with_cpu) {
+    memset(stats, 0, sizeof *stats);
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        stats->trees++;
+        if ((*it)->teardown_state() == TEARDOWN_STOPPING) {
+            stats->stopping++;
+        } else if ((*it)->teardown_state() == TEARDOWN_KILLING) {
+            stats->killing++;
+        }
+        stats->live_pids += (*it)->live_procs();
+        if (with_cpu) {
+            unsigned long long utime, stime;
+            (*it)->get_usage_usec(utime, stime);
+            stats->utime_usec += utime;
+            stats->stime_usec += stime;
+        }
+    }
+    stats->ignored_forks = m_ignored_forks;
+    stats->ignored_exits = m_ignored_exits;
+    stats->index_entries = m_index.size();
+    stats->shared_entries = m_shared.size();
+    stats->trigger_entries = m_triggers.size();
+    stats->pending_exit_stats = m_exit_stats.size();
+    stats->table_bytes = footprint();
+    stats->usage_budget_ppm = m_usage_budget * 10000;
+    stats->usage_interval_ms = m_usage_interval;
+    stats->usage_passes = m_usage_passes;
+    stats->usage_cpu_ns = m_usage_cpu_ns;
+    stats->usage_sampled = m_usage_sampled;
+    stats->usage_deferred = m_usage_deferred;
+    stats->usage_resting = m_usage_resting;
+}
+
+int Tracker::teardown() {
+    int next = -1;
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        int ms = (*it)->teardown_step();
+        if ((ms >= 0) && ((next < 0) || (ms < next))) {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+void Tracker::watch_ready() {
+    struct epoll_event evs[16];
+    int count, idx;
+    if (m_watch_epoll < 0) {
+        return;
+    }
+    while ((count = epoll_wait(m_watch_epoll, evs, 16, 0)) > 0) {
+        for (idx = 0; idx < count; idx++) {
+            pid_t pid = evs[idx].data.u64;
+            TreeList::const_iterator it;
+            for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+                if (((*it)->get_pid() == pid) || ((*it)->get_alt_pid() == pid)) {
+                    (*it)->watch_exited(pid);
+                }
+            }
+        }
+    }
+}
+
+void Tracker::usage() {
+    struct usage_pass pass;
+    memset(&pass, 0, sizeof pass);
+    pass.number = ++m_usage_passes;
+    uint64_t start = thread_cpu_ns();
+    uint64_t share = m_usage_budget / 100 * m_usage_interval * 1000000;
+    pass.deadline = start + share;
+    TreeList::const_iterator it;
+    for (it = m_trees.begin(); (it != m_trees.end()) && !pass.spent; ++it) {
+        (*it)->usage(pass, true);
+    }
+    for (it = m_trees.begin(); it != m_trees.end(); ++it) {
+        (*it)->usage(pass, false);
+    }
+    uint64_t cost = thread_cpu_ns() - start;
+    m_usage_cpu_ns += cost;
+    m_usage_sampled += pass.sampled;
+    m_usage_deferred += pass.deferred;
+    m_usage_resting = pass.resting;
+    clock_gettime(CLOCK_MONOTONIC, &m_usage_ts);
+
+    if (pass.deferred || !pass.busy) {
+        m_usage_interval *= 2;
+    } else if (cost * 4 < share) {
+        m_usage_interval /= 2;
+    }
+    if (m_usage_interval < usage_floor()) {
+        m_usage_interval = usage_floor();
+    } else if (m_usage_interval > USAGE_INTERVAL_MAX_MS) {
+        m_usage_interval = USAGE_INTERVAL_MAX_MS;
+    }
+}
+
+// Milliseconds until the next usage pass, or -1 if none is needed.
+int Tracker::usage_due() {
+    if (m_trees.empty()) {
+        return -1;
+    }
+    long elapsed = ms_since(&m_usage_ts);
+    return (elapsed < m_usage_interval) ? m_usage_interval - elapsed : 0;
+}
+
+void Tracker::log_usage_sampling() {
+    if (!m_usage_passes) {
+        return;
+    }
+    unsigned long long due = m_usage_sampled + m_usage_deferred;
+    syslog(LOG_INFO, "Usage sampling: budget %g%% of a CPU, used %.3g%%; %u passes, last interval %ld ms; "
+        "sampled %llu pids, deferred %llu (coverage %.1f%%), %llu idle pids resting\n",
+        m_usage_budget, m_usage_cpu_ns / 1e4 / (ms_since(&m_usage_start) + 1),
+        m_usage_passes, m_usage_interval, m_usage_sampled, m_usage_deferred,
+        due ? 100.0 * m_usage_sampled / due : 100.0, m_usage_resting);
+}
+
+// The C interface to the default tracker.
+
+void set_max_pid(pid_t max_pid) {
+    if (max_pid > 0) {
+        gMaxPid = max_pid;
+        gTracker.reserve(max_pid);
+    }
+}
+
+int register_tree(pid_t watch, pid_t alt_watch, int lock_fd, const char *lockfile, const char *cgroup) {
+    return gTracker.register_tree(watch, alt_watch, lock_fd, lockfile, cgroup);
+}
+
+void set_track_hook(track_hook_t hook) {
+    gTracker.set_track_hook(hook);
+}
+
+int initialize(pid_t watch, pid_t alt_watch) {
+    return gTracker.register_tree(watch, alt_watch, -1, NULL, NULL);
+}
+
+int is_done() {
+    return gTracker.is_done();
+}
+
+int reap_trees() {
+    return gTracker.reap_trees();
+}
+
+void finalize() {
+    gTracker.finalize();
 }
 
 int processFork(pid_t parent_pid, pid_t child_pid) {
-    return gTree->fork(parent_pid, child_pid);
+    return gTracker.fork(parent_pid, child_pid);
+}
+
+void processExitStats(pid_t pid, const struct exit_stats *stats) {
+    gTracker.exit_stats(pid, stats);
+}
+
+int processExit(pid_t pid, uint64_t exited_ns) {
+    return gTracker.exit(pid, exited_ns);
+}
+
+int processResync(const struct proc_snapshot *snap) {
+    return gTracker.resync(snap);
+}
+
+size_t memory_footprint() {
+    return gTracker.footprint();
+}
+
+void visit_trees(tree_visitor_t visit, void *ctx) {
+    gTracker.visit(visit, ctx);
+}
+
+void get_tracker_stats(struct tracker_stats *stats, int with_cpu) {
+    gTracker.stats(stats, with_cpu);
 }
 
-int processExit(pid_t pid) {
-    return gTree->exit(pid);
+int processTeardown() {
+    return gTracker.teardown();
+}
+
+int processWatchFd() {
+    return gTracker.watch_fd();
+}
+
+void processWatchReady() {
+    gTracker.watch_ready();
+}
+
+void set_usage_polling(int enabled) {
+    gTracker.set_usage_polling(enabled);
+}
+
+void set_exact_exits(int exact) {
+    gTracker.set_exact_exits(exact);
+}
+
+unsigned int tracked_pids() {
+    return gTracker.tracked_pids();
+}
+
+void set_usage_budget(double percent) {
+    gTracker.set_usage_budget(percent);
 }
 
 void processUsage() {
-    gTree->usage();
+    gTracker.usage();
 }
 
-#pragma GCC visibility pop
+int processUsageDue() {
+    return gTracker.usage_due();
+}
+
+// Further trackers, each with trees and an index of its own.
+
+struct tracker *tracker_create() {
+    return reinterpret_cast<struct tracker *>(new Tracker());
+}
+
+void tracker_destroy(struct tracker *tracker) {
+    Tracker *self = reinterpret_cast<Tracker *>(tracker);
+    self->finalize();
+    delete self;
+}
+
+int tracker_register(struct tracker *tracker, pid_t watch, pid_t alt_watch) {
+    return reinterpret_cast<Tracker *>(tracker)->register_tree(watch, alt_watch, -1, NULL, NULL);
+}
+
+int tracker_fork(struct tracker *tracker, pid_t parent_pid, pid_t child_pid) {
+    return reinterpret_cast<Tracker *>(tracker)->fork(parent_pid, child_pid);
+}
+
+int tracker_exit(struct tracker *tracker, pid_t pid) {
+    return reinterpret_cast<Tracker *>(tracker)->exit(pid, 0);
+}
+
+void tracker_usage(struct tracker *tracker) {
+    reinterpret_cast<Tracker *>(tracker)->usage();
+}
+
+int tracker_resync(struct tracker *tracker, const struct proc_snapshot *snap) {
+    return reinterpret_cast<Tracker *>(tracker)->resync(snap);
+}
+
+int tracker_teardown(struct tracker *tracker) {
+    return reinterpret_cast<Tracker *>(tracker)->teardown();
+}
+
+int tracker_reap(struct tracker *tracker) {
+    return reinterpret_cast<Tracker *>(tracker)->reap_trees();
+}
+
+int tracker_is_done(struct tracker *tracker) {
+    return reinterpret_cast<Tracker *>(tracker)->is_done();
+}
 
+size_t tracker_footprint(struct tracker *tracker) {
+    return reinterpret_cast<Tracker *>(tracker)->footprint();
+}
+
+void tracker_visit(struct tracker *tracker, tree_visitor_t visit, void *ctx) {
+    reinterpret_cast<Tracker *>(tracker)->visit(visit, ctx);
+}
+
+#pragma GCC visibility pop
@@ -4,6 +4,7 @@
 #ifndef __PROC_KEEPER_H
 #define __PROC_KEEPER_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -13,9 +14,97 @@ extern "C" {
 int is_done();
 void finalize();
 int initialize(pid_t, pid_t);
+void set_max_pid(pid_t);
+// Track a payload: watched pid, trigger pid, pool account lockfile fd and
+// name (or -1/NULL), and its cgroup directory (or NULL).
+int register_tree(pid_t, pid_t, int, const char *, const char *);
+int reap_trees();
 int processFork(pid_t, pid_t);
-int processExit(pid_t);
+// exited_ns is the kernel's CLOCK_MONOTONIC timestamp of the exit, from
+// which teardown latency is measured, or 0 to measure from now.
+int processExit(pid_t, uint64_t exited_ns);
+// Exact accounting for an exited thread of a tracked pid; the threads of a
+// process are added up until its exit event arrives.
+struct exit_stats;
+void processExitStats(pid_t, const struct exit_stats *);
+// One pass of usage sampling, within its share of the CPU budget.
 void processUsage();
+// Milliseconds until the next pass is due, or -1 if none is.
+int processUsageDue();
+// Whether processUsage samples at its full rate even when exits are
+// accounted exactly; otherwise a slow pass keeps live CPU current.
+void set_usage_polling(int);
+// Whether taskstats reports the exits of tracked processes.
+void set_exact_exits(int);
+// How many pids the trees hold.
+unsigned int tracked_pids();
+// The CPU usage sampling may take, in percent of one CPU.
+void set_usage_budget(double);
+// An fd that becomes readable when a watched or trigger pid exits (or -1),
+// and the call that starts the teardown of its trees right away, without
+// waiting for the exit event to come through the kernel queue.
+int processWatchFd();
+void processWatchReady();
+// Advance trees that are being stopped for teardown.  Returns the
+// milliseconds until the next step is due, or -1 if none is.
+int processTeardown();
+// Bytes held by the pid tables of the index and every tree.
+size_t memory_footprint();
+// Call visit with each tree's watched and trigger pids, its number of live
+// members and whether it is being torn down.
+typedef void (*tree_visitor_t)(pid_t, pid_t, unsigned int, int, void *);
+void visit_trees(tree_visitor_t, void *);
+// Counts describing the trees and the tables behind them.  The CPU totals
+// are only filled in on request, as they may read cgroup files.
+struct tracker_stats {
+    unsigned int trees;
+    unsigned int stopping;                // trees being stopped for teardown
+    unsigned int killing;                 // trees killed, waiting for exits
+    unsigned long long live_pids;
+    unsigned long long ignored_forks;     // forks by untracked parents
+    unsigned long long ignored_exits;     // exits of untracked pids
+    unsigned long long index_entries;
+    unsigned long long shared_entries;    // pids owned by nested trees
+    unsigned long long trigger_entries;
+    unsigned long long pending_exit_stats;
+    unsigned long long table_bytes;
+    unsigned long long utime_usec;
+    unsigned long long stime_usec;
+    unsigned long long usage_budget_ppm;  // of one CPU
+    unsigned long long usage_interval_ms;
+    unsigned long long usage_passes;
+    unsigned long long usage_cpu_ns;      // spent sampling
+    unsigned long long usage_sampled;     // pids sampled, over all passes
+    unsigned long long usage_deferred;    // due, but over budget
+    unsigned long long usage_resting;     // idle and not due, last pass
+};
+void get_tracker_stats(struct tracker_stats *, int with_cpu);
+struct proc_snapshot;
+int processResync(const struct proc_snapshot *);
+
+// Everything above acts on the trees of the monitor itself.  Benchmarks
+// and stress tests can drive any number of independent trackers alongside,
+// each with trees and an index of its own.
+struct tracker;
+struct tracker *tracker_create();
+// Finalizes any trees still registered.
+void tracker_destroy(struct tracker *);
+int tracker_register(struct tracker *, pid_t, pid_t);
+int tracker_fork(struct tracker *, pid_t, pid_t);
+int tracker_exit(struct tracker *, pid_t);
+void tracker_usage(struct tracker *);
+int tracker_resync(struct tracker *, const struct proc_snapshot *);
+int tracker_teardown(struct tracker *);
+int tracker_reap(struct tracker *);
+int tracker_is_done(struct tracker *);
+size_t tracker_footprint(struct tracker *);
+void tracker_visit(struct tracker *, tree_visitor_t, void *);
+
+// Called whenever a pid starts to matter to a tree, so that a kernel-side
+// filter can follow along.  member is 1 for tree members (whose children
+// are adopted) and 0 for trigger pids, whose exit is all that matters.
+typedef void (*track_hook_t)(pid_t, int member);
+void set_track_hook(track_hook_t);
 
 #ifdef __cplusplus
 }
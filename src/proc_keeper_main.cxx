@@ -1,3 +1,4 @@
+#include "config.h"
 
 #include <dirent.h>
 #include <stdio.h>
@@ -7,38 +8,111 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
 
 extern "C" {
 #include "proc_police.h"
 #include "proc_keeper.h"
+#include "proc_daemon.h"
+#include "proc_ebpf.h"
+#include "proc_scan.h"
+#include "proc_cgroup.h"
+#include "proc_taskstats.h"
+#include "proc_pool.h"
+#include "proc_trace.h"
+#include "proc_source.h"
+#include "proc_latency.h"
+#include "proc_stats.h"
+#include "proc_log.h"
 }
 
-int proc_police_main(pid_t pid, pid_t parent_pid) {
-    int result = 0;
-
-    syslog(LOG_INFO, "Process %d monitoring process %d\n", getpid(), pid);
-
-    initialize(pid, parent_pid);
+// Record everything fed to the trees here, for process-tracking-replay.
+static const char *g_trace_path = NULL;
+// Where to publish live counters; empty to publish none.
+static const char *g_stats_dir = STATS_DIR;
+
+/**
+ * Subscribe to exit accounting.  Without it, whatever a process used since
+ * its last /proc sample is lost.
+ */
+static void open_taskstats() {
+    if (taskstats_open() < 0) {
+        syslog(LOG_WARNING, "No taskstats exit accounting; sampling CPU usage from /proc.\n");
+    }
+}
 
+/**
+ * Create the netlink socket, attach the filter and subscribe to the kernel
+ * feed.  Returns the socket or a negative errno.
+ */
+int subscribe_netlink() {
     // Create the netlink socket.
     int sock = create_socket();
     if (sock < 0) {
-        result = sock;
         syslog(LOG_ERR, "Unable to create socket.\n");
-        goto cleanup;
+        return sock;
     }
     //syslog(LOG_DEBUG, "Created netlink socket (%d) for kernel communication.\n", sock);
 
     // Create the filter for the socket
+    int result;
     if ((result = create_filter(sock)) < 0) {
         syslog(LOG_ERR, "Unable to create filter.\n");
-        goto cleanup;
+        close(sock);
+        return result;
     }
     //syslog(LOG_DEBUG, "Created netlink byte packet filter.\n");
 
     // Subscribe our socket to the kernel feed.
     if ((result = inform_kernel(sock, PROC_CN_MCAST_LISTEN)) < 0) {
         syslog(LOG_ERR, "Unable to subscribe to the kernel stream\n");
+        close(sock);
+        return result;
+    }
+    return sock;
+}
+
+/**
+ * Start the eBPF backend if it was compiled in and the kernel supports it.
+ * Must happen before any tree is registered.
+ */
+struct ebpf_tracker *open_ebpf() {
+#ifdef HAVE_EBPF
+    struct ebpf_tracker *ebpf = ebpf_open();
+    if (ebpf) {
+        syslog(LOG_INFO, "Using the eBPF event backend.\n");
+    } else {
+        syslog(LOG_INFO, "eBPF backend unavailable; falling back to the proc connector.\n");
+    }
+    return ebpf;
+#else
+    return NULL;
+#endif
+}
+
+int proc_police_main(pid_t pid, pid_t parent_pid, const char *cgroup) {
+    int result = 0;
+    int sock = -1;
+
+    syslog(LOG_INFO, "Process %d monitoring process %d\n", getpid(), pid);
+
+    struct ebpf_tracker *ebpf = open_ebpf();
+
+    // Without a usable cgroup we fall back to killing the tree pid by pid.
+    if (cgroup && (cgroup_check(cgroup) < 0)) {
+        cgroup = NULL;
+    }
+    trace_register(pid, parent_pid);
+    register_tree(pid, parent_pid, -1, NULL, cgroup);
+
+    if (!ebpf && ((sock = subscribe_netlink()) < 0)) {
+        result = sock;
         goto cleanup;
     }
 
@@ -59,9 +133,28 @@ int proc_police_main(pid_t pid, pid_t parent_pid) {
     open("/dev/null", O_WRONLY);
     close(0);
     open("/dev/null", O_RDONLY);
+    // From here on, the event path does not wait on syslog.
+    log_start();
+
+    // The cgroup accounts for the whole payload by itself.  Otherwise a
+    // small payload is sampled; taskstats, which wakes us for every exit
+    // on the node, only pays off once the payload has grown.
+    if (!cgroup) {
+        set_taskstats_threshold(TASKSTATS_MONITOR_PIDS);
+    }
+    // Pick up whatever the payload forked before events started flowing.
+    proc_seed();
 
     // Primary message loop
-    message_loop(sock);
+#ifdef HAVE_EBPF
+    if (ebpf) {
+        ebpf_message_loop(ebpf, -1);
+        goto cleanup;
+    }
+#endif
+    struct event_source events;
+    source_netlink(&events, sock);
+    message_loop(&events, -1);
 
     // Shutdown
     if ((result = inform_kernel(sock, PROC_CN_MCAST_IGNORE)) < 0) {
@@ -71,13 +164,164 @@ int proc_police_main(pid_t pid, pid_t parent_pid) {
 
 cleanup:
     finalize();
+    log_stop();
+    taskstats_close();
+#ifdef HAVE_EBPF
+    ebpf_close(ebpf);
+#endif
     if (sock >= 0) {
         close(sock);
     }
+    log_latency();
     syslog(LOG_NOTICE, "Process %d (monitoring process %d) finished with code %d.\n", getpid(), pid, result);
     return result;
 }
 
+int proc_daemon_main(const char *path) {
+    int result = 0;
+    int ctl_sock = -1;
+    int sock = -1;
+
+    syslog(LOG_INFO, "Process %d serving tracking registrations on %s\n", getpid(), path);
+
+    // A single kernel subscription is shared by every registered payload.
+    struct ebpf_tracker *ebpf = open_ebpf();
+    if (!ebpf && ((sock = subscribe_netlink()) < 0)) {
+        result = sock;
+        goto cleanup;
+    }
+    open_taskstats();
+
+    // Only accept registrations once we are actually receiving events.
+    if ((ctl_sock = create_control_socket(path)) < 0) {
+        result = ctl_sock;
+        syslog(LOG_ERR, "Unable to create control socket.\n");
+        goto cleanup;
+    }
+
+    syslog(LOG_NOTICE, "TRACKING daemon listening on %s\n", path);
+
+    closelog();
+    openlog("process-tracking", LOG_NDELAY|LOG_PID, LOG_DAEMON);
+    log_start();
+
+#ifdef HAVE_EBPF
+    if (ebpf) {
+        result = ebpf_message_loop(ebpf, ctl_sock);
+        goto cleanup;
+    }
+#endif
+    struct event_source events;
+    source_netlink(&events, sock);
+    result = message_loop(&events, ctl_sock);
+
+cleanup:
+    finalize();
+    log_stop();
+    taskstats_close();
+#ifdef HAVE_EBPF
+    ebpf_close(ebpf);
+#endif
+    if (ctl_sock >= 0) {
+        close(ctl_sock);
+        unlink(path);
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    log_latency();
+    syslog(LOG_NOTICE, "Process %d (tracking daemon) finished with code %d.\n", getpid(), result);
+    return result;
+}
+
+/**
+ * An idle monitor in the pool: subscribe now, then wait to be handed a
+ * payload.  Once claimed, it tracks that payload like a private monitor.
+ */
+static int standby_main(int chan) {
+    int result = 0;
+    int conn = -1;
+
+    // Subscribed, but not woken by every event on the node while idle.
+    int sock = subscribe_netlink();
+    if ((sock < 0) || ((result = netlink_pause(sock)) < 0)) {
+        result = (sock < 0) ? sock : result;
+        goto cleanup;
+    }
+    if ((conn = pool_claim(chan)) < 0) {
+        result = (conn == -ECANCELED) ? 0 : conn;
+        goto cleanup;
+    }
+    close(chan);
+    chan = -1;
+    log_start();
+    // One trace per payload.
+    if (g_trace_path) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "%s.%d", g_trace_path, getpid());
+        trace_open(path);
+    }
+    if (g_stats_dir[0]) {
+        stats_open(g_stats_dir, STATS_POOL_MONITOR, 0);
+    }
+    if ((result = netlink_resume(sock)) < 0) {
+        close(conn);
+        goto cleanup;
+    }
+    if ((result = serve_registration(conn)) < 0) {
+        goto cleanup;
+    }
+    open_taskstats();
+    proc_seed();
+
+    struct event_source events;
+    source_netlink(&events, sock);
+    result = message_loop(&events, -1);
+
+cleanup:
+    finalize();
+    log_stop();
+    taskstats_close();
+    trace_close();
+    stats_close();
+    if (chan >= 0) {
+        close(chan);
+    }
+    if (sock >= 0) {
+        inform_kernel(sock, PROC_CN_MCAST_IGNORE);
+        close(sock);
+    }
+    if (conn >= 0) {
+        log_latency();
+        syslog(LOG_NOTICE, "Process %d (pool monitor) finished with code %d.\n", getpid(), result);
+    }
+    return result ? 1 : 0;
+}
+
+int proc_pool_main(const char *path, unsigned int size) {
+    int result = 0;
+
+    syslog(LOG_INFO, "Process %d keeping %u idle monitors for registrations on %s\n", getpid(), size, path);
+
+    int ctl_sock = create_control_socket(path);
+    if (ctl_sock < 0) {
+        syslog(LOG_ERR, "Unable to create control socket.\n");
+        return ctl_sock;
+    }
+
+    syslog(LOG_NOTICE, "TRACKING pool listening on %s\n", path);
+
+    closelog();
+    openlog("process-tracking", LOG_NDELAY|LOG_PID, LOG_DAEMON);
+
+    result = pool_run(ctl_sock, size, standby_main);
+
+    close(ctl_sock);
+    unlink(path);
+    syslog(LOG_NOTICE, "Process %d (monitor pool) finished with code %d.\n", getpid(), result);
+    return result;
+}
+
 pid_t get_max_pid() {
 
     int rc;
@@ -152,20 +396,140 @@ cleanup:
     return rc;
 }
 
+// Close out unused fds.  LCMAPS shouldn't leak FDs to us, but just in
+// case...
+int close_unused_fds() {
+    // 0 and 1 are closed in proc_polic_main;
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0) {
+        return 0;
+    }
+    // Before 5.9, walk /proc/self/fd.
+    int max_fd = get_fd_max();
+    syslog(LOG_DEBUG, "Max FD: %d.\n", max_fd);
+    if (max_fd < 0) {
+        return -1;
+    }
+    int idx;
+    for (idx = 3; idx<=max_fd; idx++) {
+        close(idx); // Ignore exit.
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
 
     // While we are processing arguments and starting up, log to stderr.
     openlog("process-tracking", LOG_PID|LOG_PERROR, LOG_DAEMON);
 
+    // Size the pid tables for this system.
+    pid_t pid_max = get_max_pid();
+    set_max_pid(pid_max);
+
+    // Usage sampling keeps a /proc fd open for each tracked pid.
+    struct rlimit rl;
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < rl.rlim_max)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    while (argc >= 2) {
+        if (strcmp(argv[1], "--poll-usage") == 0) {
+            // Sample at the full rate even when exits are exact.
+            set_usage_polling(1);
+            argc--;
+            argv++;
+        } else if ((argc >= 3) && (strcmp(argv[1], "--rcvbuf-max") == 0)) {
+            // In KiB; the netlink receive buffer never grows past it.
+            errno = 0;
+            long kib = strtol(argv[2], NULL, 10);
+            if ((kib <= 0) || (kib > INT_MAX / 1024) || (errno != 0)) {
+                syslog(LOG_ERR, "Invalid receive buffer ceiling: %s\n", argv[2]);
+                return 1;
+            }
+            set_rcvbuf_max(kib * 1024);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc >= 3) && (strcmp(argv[1], "--trace") == 0)) {
+            g_trace_path = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if ((argc >= 3) && (strcmp(argv[1], "--usage-budget") == 0)) {
+            // In percent of one CPU, for sampling usage from /proc.
+            char *end;
+            errno = 0;
+            double percent = strtod(argv[2], &end);
+            if ((percent <= 0) || (percent > 100) || *end || (errno != 0)) {
+                syslog(LOG_ERR, "Invalid usage sampling budget: %s\n", argv[2]);
+                return 1;
+            }
+            set_usage_budget(percent);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc >= 3) && (strcmp(argv[1], "--stats-dir") == 0)) {
+            g_stats_dir = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    // Shared daemon mode: one subscription for every payload on the node.
+    if ((argc >= 2) && (strcmp(argv[1], "--daemon") == 0)) {
+        if (argc > 3) {
+            syslog(LOG_ERR, "Usage: process-tracking [--poll-usage] [--rcvbuf-max <KiB>] [--usage-budget <percent>] [--trace <file>] [--stats-dir <dir>] --daemon [<socket path>]\n");
+            return 1;
+        }
+        if (close_unused_fds() < 0) {
+            return 1;
+        }
+        if (g_trace_path) {
+            trace_open(g_trace_path);
+        }
+        if (g_stats_dir[0]) {
+            stats_open(g_stats_dir, STATS_DAEMON, 0);
+        }
+        int rc = proc_daemon_main((argc == 3) ? argv[2] : PROC_TRACKING_SOCKET);
+        stats_close();
+        trace_close();
+        closelog();
+        return rc ? 1 : 0;
+    }
+
+    // Pool mode: idle, subscribed monitors handed out one per payload.
+    if ((argc >= 3) && (strcmp(argv[1], "--pool") == 0)) {
+        errno = 0;
+        long size = strtol(argv[2], NULL, 10);
+        if ((argc > 4) || (size <= 0) || (size > POOL_MAX) || (errno != 0)) {
+            syslog(LOG_ERR, "Usage: process-tracking [--poll-usage] [--rcvbuf-max <KiB>] [--usage-budget <percent>] [--trace <file>] [--stats-dir <dir>] --pool <1-%d> [<socket path>]\n", POOL_MAX);
+            return 1;
+        }
+        if (close_unused_fds() < 0) {
+            return 1;
+        }
+        int rc = proc_pool_main((argc == 4) ? argv[3] : PROC_TRACKING_SOCKET, size);
+        closelog();
+        return rc ? 1 : 0;
+    }
+
+    // The payload's own cgroup, if the plugin created one.
+    const char *cgroup = NULL;
+    if ((argc >= 3) && (strcmp(argv[1], "--cgroup") == 0)) {
+        cgroup = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
     // Input parsing and sanitation
     if ((argc != 3) && (argc != 4)) {
-        syslog(LOG_ERR, "Usage: process-tracking <pid> <ppid> [<pool account filename>]\n");
+        syslog(LOG_ERR, "Usage: process-tracking [--poll-usage] [--rcvbuf-max <KiB>] [--usage-budget <percent>] [--trace <file>] [--stats-dir <dir>] [--cgroup <dir>] <pid> <ppid> [<pool account filename>]\n");
+        syslog(LOG_ERR, "       process-tracking [--poll-usage] [--rcvbuf-max <KiB>] [--usage-budget <percent>] [--trace <file>] [--stats-dir <dir>] --daemon [<socket path>]\n");
+        syslog(LOG_ERR, "       process-tracking [--poll-usage] [--rcvbuf-max <KiB>] [--usage-budget <percent>] [--trace <file>] [--stats-dir <dir>] --pool <size> [<socket path>]\n");
         syslog(LOG_ERR, "Not enough arguments!\n");
         return 1;
     }
     const char * pool_account_filename = (argc == 4) ? argv[3] : NULL;
 
-    pid_t pid_max = get_max_pid();
     errno = 0;
     long pid = strtol(argv[1], NULL, 10);
     if (((pid == 0) || (pid == LONG_MAX) || (pid == LONG_MIN)) && (errno != 0)) {
@@ -186,18 +550,16 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Close out unused fds.  LCMAPS shouldn't leak FDs to us, but just in
-    // case...
-    int max_fd = get_fd_max();
-    syslog(LOG_DEBUG, "Max FD: %d.\n", max_fd);
-    if (max_fd < 0) {
+    if (close_unused_fds() < 0) {
         return 1;
     }
-    // 0 and 1 are closed in proc_polic_main;
-    int idx;
-    for (idx = 3; idx<=max_fd; idx++) {
-        syslog(LOG_DEBUG, "Closing FD: %d\n", idx);
-        close(idx); // Ignore exit.
+    // A trace that cannot be written is no reason to leave a payload
+    // untracked.
+    if (g_trace_path) {
+        trace_open(g_trace_path);
+    }
+    if (g_stats_dir[0]) {
+        stats_open(g_stats_dir, STATS_MONITOR, pid);
     }
 
     // If we are not using pool accounts, close 2.
@@ -205,7 +567,9 @@ int main(int argc, char *argv[]) {
       close(2);
     }
 
-    int rc = proc_police_main(pid, ppid);
+    int rc = proc_police_main(pid, ppid, cgroup);
+    stats_close();
+    trace_close();
 
     // Cleanup lockfile if used.
     if (pool_account_filename) {
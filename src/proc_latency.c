@@ -0,0 +1,75 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <syslog.h>
+
+#include "proc_latency.h"
+#include "proc_log.h"
+
+struct latency_stats g_latency;
+
+// The highest value that falls into bucket idx.
+static uint64_t bucket_top(unsigned int idx) {
+    if (idx < 2 * LATENCY_SUB) {
+        return idx;
+    }
+    unsigned int shift = idx / LATENCY_SUB - 1;
+    return ((uint64_t)(idx % LATENCY_SUB + LATENCY_SUB + 1) << shift) - 1;
+}
+
+uint64_t latency_percentile(const struct latency_hist *hist, double percent) {
+    uint64_t wanted = (uint64_t)(hist->count * percent / 100.0 + 0.5);
+    uint64_t seen = 0;
+    unsigned int idx;
+    if (!wanted) {
+        wanted = 1;
+    }
+    for (idx = 0; idx < LATENCY_BUCKETS; idx++) {
+        seen += hist->buckets[idx];
+        if (seen >= wanted) {
+            // Never report more than was actually seen.
+            uint64_t top = bucket_top(idx);
+            return (top < hist->max) ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static int format_hist(char *buf, size_t len, const char *name, const struct latency_hist *hist) {
+    if (!hist->count) {
+        return 0;
+    }
+    return snprintf(buf, len, "; %s %.0f/%.0f/%.0f/%.0f/%.0f over %llu", name,
+        latency_percentile(hist, 50) / 1e3, latency_percentile(hist, 90) / 1e3,
+        latency_percentile(hist, 99) / 1e3, latency_percentile(hist, 99.9) / 1e3,
+        hist->max / 1e3, (unsigned long long)hist->count);
+}
+
+void latency_format(char *buf, size_t len) {
+    const struct {
+        const char *name;
+        const struct latency_hist *hist;
+    } hists[] = {
+        {"kernel to dispatch", &g_latency.dispatch},
+        {"head exit to first SIGKILL", &g_latency.kill},
+        {"head exit to empty tree", &g_latency.empty},
+    };
+    size_t used = 0;
+    unsigned int idx;
+    buf[0] = '\0';
+    for (idx = 0; idx < sizeof hists / sizeof hists[0]; idx++) {
+        int count = format_hist(buf + used, len - used, hists[idx].name, hists[idx].hist);
+        if ((count < 0) || ((size_t)count >= len - used)) {
+            break;
+        }
+        used += count;
+    }
+}
+
+void log_latency() {
+    char line[512];
+    latency_format(line, sizeof line);
+    if (line[0]) {
+        log_async(LOG_CAT_STATS, LOG_INFO, "Latency in us, p50/p90/p99/p99.9/max%s\n", line);
+    }
+}
@@ -0,0 +1,63 @@
+// Latency histograms, in nanoseconds, kept the way HdrHistogram keeps them:
+// exact below 64 ns, then 32 buckets per power of two, so any value is
+// known to within about 3% in a fixed 15 KiB per histogram.  Recording is
+// a few instructions and no allocation; only the thread that owns the
+// trees records.
+
+#ifndef __PROC_LATENCY_H
+#define __PROC_LATENCY_H
+
+#include <stdint.h>
+
+#include "proc_util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency_stats {
+    struct latency_hist dispatch;   // kernel timestamp to the event being applied
+    struct latency_hist kill;       // head exit seen to the first SIGKILL
+    struct latency_hist empty;      // head exit seen to an empty tree
+};
+extern struct latency_stats g_latency;
+
+static inline void latency_record(struct latency_hist *hist, uint64_t ns) {
+    unsigned int idx;
+    if (ns < 2 * LATENCY_SUB) {
+        idx = ns;
+    } else {
+        unsigned int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+        idx = (shift + 1) * LATENCY_SUB + (unsigned int)(ns >> shift) - LATENCY_SUB;
+    }
+    hist->buckets[idx]++;
+    hist->count++;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+// The value at or below which `percent` of the recorded values fall, to
+// the histogram's precision.
+uint64_t latency_percentile(const struct latency_hist *, double percent);
+
+// "; <name> p50/p90/p99/p99.9/max over <count>", in microseconds, for
+// every histogram with values in it; empty if there are none.
+void latency_format(char *buf, size_t len);
+void log_latency();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+
+/**
+ * Wall time of the plugin's plugin_run: from the call to a tracking monitor
+ * being up and subscribed.  Run with `make bench-launch`, as root.
+ *
+ * With -s, the plugin registers with the daemon or monitor pool listening
+ * on that socket instead of launching a monitor of its own.
+ *
+ * The plugin is loaded as LCMAPS would load it, against the minimal LCMAPS
+ * API stubbed out below.  Each launch happens in a child standing in for
+ * glexec; once it has its monitor it exits, and the monitor with it.  The
+ * monitors are reparented to us, so each is reaped before the next launch.
+ */
+
+#include "config.h"
+
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "proc_util.h"
+
+static int g_verbose = 0;
+
+// The parts of the LCMAPS API the plugin uses.  No credentials: no pool
+// accounts.
+static int log_stub(const char *fmt, va_list ap) {
+    if (g_verbose) {
+        vfprintf(stderr, fmt, ap);
+    }
+    return 0;
+}
+
+int lcmaps_log(int prty, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_stub(fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+int lcmaps_log_debug(int debug_lvl, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_stub(fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+int lcmaps_log_time(int prty, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_stub(fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+void *getCredentialData(int datatype, int *count) {
+    *count = 0;
+    return NULL;
+}
+
+int lcmaps_cntArgs(void *argvars) {
+    return 0;
+}
+
+typedef int (*plugin_initialize_t)(int, char **);
+typedef int (*plugin_run_t)(int, void *);
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Time `launches` calls to plugin_run, one at a time.
+ */
+static int bench_launch(plugin_run_t plugin_run, unsigned int launches) {
+    double *times = calloc(launches, sizeof *times);
+    unsigned int idx, done = 0, failed = 0;
+    double total = 0;
+    if (!times) {
+        return -ENOMEM;
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    for (idx = 0; idx < launches; idx++) {
+        int report[2];
+        if (pipe(report) == -1) {
+            free(times);
+            return -errno;
+        }
+        pid_t glexec = fork();
+        if (glexec == 0) {
+            struct timespec start, end;
+            close(report[0]);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            double ms = plugin_run(0, NULL) ? -1 : 0;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (!ms) {
+                ms = ms_between(&start, &end);
+            }
+            if (write(report[1], &ms, sizeof ms) != sizeof ms) {}
+            _exit(0);
+        }
+        close(report[1]);
+        double ms;
+        ssize_t len = (glexec > 0) ? read(report[0], &ms, sizeof ms) : -1;
+        close(report[0]);
+        if (len != sizeof ms) {
+            fprintf(stderr, "launch %u did not report\n", idx);
+            failed++;
+        } else if (ms < 0) {
+            failed++;
+        } else {
+            times[done++] = ms;
+            total += ms;
+        }
+        // The stand-in glexec, and then its monitor once it notices.
+        while (waitpid(-1, NULL, 0) > 0) {}
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+
+    if (done) {
+        qsort(times, done, sizeof *times, compare_double);
+        printf("plugin_run:    %6u launches %8.3f ms mean   %8.3f ms median   %8.3f ms p99   %8.3f ms worst\n",
+            done, total / done, times[done / 2], times[(done * 99) / 100], times[done - 1]);
+    }
+    if (failed) {
+        printf("plugin_run:    %6u launches failed\n", failed);
+    }
+    free(times);
+    return failed ? -ECHILD : 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int launches = 1000;
+    char *socket_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+            case 'n': launches = atoi(optarg); break;
+            case 's': socket_path = optarg; break;
+            case 'v': g_verbose = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n launches] [-s socket] [-v] <plugin.so> <monitor binary>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-n launches] [-s socket] [-v] <plugin.so> <monitor binary>\n", argv[0]);
+        return 1;
+    }
+
+    void *plugin = dlopen(argv[optind], RTLD_NOW);
+    if (!plugin) {
+        fprintf(stderr, "Unable to load %s: %s\n", argv[optind], dlerror());
+        return 1;
+    }
+    plugin_initialize_t plugin_initialize = (plugin_initialize_t)dlsym(plugin, "plugin_initialize");
+    plugin_run_t plugin_run = (plugin_run_t)dlsym(plugin, "plugin_run");
+    if (!plugin_initialize || !plugin_run) {
+        fprintf(stderr, "%s is not an LCMAPS plugin\n", argv[optind]);
+        return 1;
+    }
+    char *args[] = {"process_tracking", "-path", argv[optind + 1], "-socket", socket_path, NULL};
+    if (plugin_initialize(socket_path ? 5 : 3, args)) {
+        fprintf(stderr, "plugin_initialize failed\n");
+        return 1;
+    }
+    return bench_launch(plugin_run, launches) ? 1 : 0;
+}
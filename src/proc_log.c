@@ -0,0 +1,285 @@
+#include "config.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_log.h"
+
+// Must be a power of two.
+#define LOG_RING_SIZE 256
+// Room for the longest line, the periodic loop statistics.
+#define LOG_RECORD_MAX 512
+
+struct log_record {
+    unsigned int seq;
+    int priority;
+    char text[LOG_RECORD_MAX];
+};
+
+struct log_limit {
+    const char *name;
+    unsigned int per_second;        // 0: never thinned nor dropped
+    uint64_t window;                // the second being counted
+    unsigned int count;
+    unsigned long long suppressed;
+};
+
+// A bounded multi-producer ring: a producer claims a slot by moving tail,
+// fills it and bumps the slot's seq; the writer owns head.
+static struct {
+    struct log_record slots[LOG_RING_SIZE];
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned int head __attribute__((aligned(64)));
+    unsigned long long full;        // records lost to a full ring
+    int sleeping;
+    int running;
+    int stopping;
+    int efd;
+    pthread_t writer;
+} g_log = {.efd = -1};
+
+// Trees must never lose their accounting lines: there are a handful per
+// tree, so they have no budget, and if the ring is full they are written
+// directly, at the cost of stalling the caller.  The rest can be thinned.
+static struct log_limit g_limits[LOG_CAT_COUNT] = {
+    [LOG_CAT_TREE] = {"tree", 0},
+    [LOG_CAT_SIGNAL] = {"signal failure", 20},
+    [LOG_CAT_OVERFLOW] = {"overflow", 5},
+    [LOG_CAT_ERROR] = {"error", 20},
+    [LOG_CAT_STATS] = {"statistics", 10},
+};
+
+static uint64_t now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+static void wake_writer() {
+    // Pairs with the fence in writer_main.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_log.sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(g_log.efd, &one, sizeof one) == -1) {}
+    }
+}
+
+// Whether the category still has room this second.
+static int log_admit(struct log_limit *limit) {
+    if (!limit->per_second) {
+        return 1;
+    }
+    uint64_t now = now_seconds();
+    uint64_t window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+    if ((window != now) && __atomic_compare_exchange_n(&limit->window, &window, now, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED) >= limit->per_second) {
+        // The writer sleeps until there is something to report.
+        if (!__atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED)) {
+            wake_writer();
+        }
+        return 0;
+    }
+    return 1;
+}
+
+void log_async(enum log_category cat, int priority, const char *fmt, ...) {
+    va_list ap;
+    if (!log_admit(&g_limits[cat])) {
+        return;
+    }
+    if (!__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)) {
+        goto direct;
+    }
+
+    struct log_record *rec;
+    unsigned int pos = __atomic_load_n(&g_log.tail, __ATOMIC_RELAXED);
+    while (1) {
+        rec = &g_log.slots[pos & (LOG_RING_SIZE - 1)];
+        int diff = (int)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_log.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            if (!g_limits[cat].per_second) {
+                goto direct;
+            }
+            if (!__atomic_fetch_add(&g_log.full, 1, __ATOMIC_RELAXED)) {
+                wake_writer();
+            }
+            return;
+        } else {
+            pos = __atomic_load_n(&g_log.tail, __ATOMIC_RELAXED);
+        }
+    }
+    rec->priority = priority;
+    va_start(ap, fmt);
+    vsnprintf(rec->text, sizeof rec->text, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    wake_writer();
+    return;
+
+direct:
+    va_start(ap, fmt);
+    vsyslog(priority, fmt, ap);
+    va_end(ap);
+}
+
+// The last record written, so that repeats of it can be counted instead.
+struct log_last {
+    int priority;
+    unsigned int repeats;
+    char text[LOG_RECORD_MAX];
+};
+
+static void flush_repeats(struct log_last *last) {
+    if (last->repeats) {
+        syslog(last->priority, "Last message repeated %u times.\n", last->repeats);
+        last->repeats = 0;
+    }
+}
+
+// Whether anything is waiting for report_suppressed.
+static int report_pending(const struct log_last *last) {
+    unsigned int cat;
+    if (last->repeats || __atomic_load_n(&g_log.full, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+    for (cat = 0; cat < LOG_CAT_COUNT; cat++) {
+        if (__atomic_load_n(&g_limits[cat].suppressed, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void report_suppressed(struct log_last *last) {
+    unsigned long long count;
+    unsigned int cat;
+    flush_repeats(last);
+    for (cat = 0; cat < LOG_CAT_COUNT; cat++) {
+        if ((count = __atomic_exchange_n(&g_limits[cat].suppressed, 0, __ATOMIC_RELAXED))) {
+            syslog(LOG_WARNING, "Suppressed %llu %s messages over the limit of %u a second.\n",
+                count, g_limits[cat].name, g_limits[cat].per_second);
+        }
+    }
+    if ((count = __atomic_exchange_n(&g_log.full, 0, __ATOMIC_RELAXED))) {
+        syslog(LOG_WARNING, "Dropped %llu log messages; the log ring was full.\n", count);
+    }
+}
+
+// Write out every record queued.  Returns how many there were.
+static unsigned int drain(struct log_last *last) {
+    unsigned int count = 0;
+    while (1) {
+        struct log_record *rec = &g_log.slots[g_log.head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != g_log.head + 1) {
+            break;
+        }
+        if ((rec->priority == last->priority) && !strcmp(rec->text, last->text)) {
+            last->repeats++;
+        } else {
+            flush_repeats(last);
+            syslog(rec->priority, "%s", rec->text);
+            last->priority = rec->priority;
+            memcpy(last->text, rec->text, sizeof last->text);
+        }
+        __atomic_store_n(&rec->seq, g_log.head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        g_log.head++;
+        count++;
+    }
+    return count;
+}
+
+static void *writer_main(void *arg) {
+    struct log_last last;
+    uint64_t reported = now_seconds();
+    memset(&last, 0, sizeof last);
+    last.priority = -1;
+    while (!__atomic_load_n(&g_log.stopping, __ATOMIC_ACQUIRE)) {
+        if (drain(&last)) {
+            continue;
+        }
+        if (now_seconds() != reported) {
+            report_suppressed(&last);
+            reported = now_seconds();
+        }
+        __atomic_store_n(&g_log.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!drain(&last)) {
+            struct pollfd pfd = {g_log.efd, POLLIN, 0};
+            // Only come back on our own to report what was suppressed or
+            // repeated, at most once a second.
+            if (poll(&pfd, 1, report_pending(&last) ? 1000 : -1) > 0) {
+                uint64_t value;
+                if (read(g_log.efd, &value, sizeof value) == -1) {}
+            }
+        }
+        __atomic_store_n(&g_log.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    drain(&last);
+    report_suppressed(&last);
+    return NULL;
+}
+
+int log_start() {
+    sigset_t all, old;
+    int result;
+    unsigned int idx;
+    if (g_log.running) {
+        return 0;
+    }
+    for (idx = 0; idx < LOG_RING_SIZE; idx++) {
+        g_log.slots[idx].seq = idx;
+    }
+    g_log.head = g_log.tail = 0;
+    g_log.stopping = 0;
+    g_log.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_log.efd == -1) {
+        syslog(LOG_ERR, "Unable to create eventfd: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    // Shutdown signals go to the event loop's signalfd, never to the writer.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    result = pthread_create(&g_log.writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (result) {
+        syslog(LOG_ERR, "Unable to start log writer: %d %s\n", result, strerror(result));
+        close(g_log.efd);
+        g_log.efd = -1;
+        return -result;
+    }
+    __atomic_store_n(&g_log.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop() {
+    if (!g_log.running) {
+        return;
+    }
+    // Called once the event loop has returned, so nothing is mid-record;
+    // anything logged from here on goes straight to syslog.
+    __atomic_store_n(&g_log.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_log.stopping, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(g_log.efd, &one, sizeof one) == -1) {}
+    pthread_join(g_log.writer, NULL);
+    close(g_log.efd);
+    g_log.efd = -1;
+}
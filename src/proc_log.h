@@ -0,0 +1,40 @@
+// Logging for the event path.  log_async formats into a lock-free ring and
+// returns; a writer thread started with log_start hands the records to
+// syslog, so a slow /dev/log never holds up the reader or the processor.
+// Until log_start, or after log_stop, records go straight to syslog.
+//
+// Each category but trees has a budget of records per second; records over
+// it are counted, not formatted, and the count is logged once a second.
+// Tree records are never lost: if the ring is full they go straight to
+// syslog.  A run of identical records is logged once, followed by how often
+// it repeated.
+//
+// The writer does not survive fork(); a child must call log_start itself.
+
+#ifndef __PROC_LOG_H
+#define __PROC_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum log_category {
+    LOG_CAT_TREE,       // trees starting, exiting and being accounted for
+    LOG_CAT_SIGNAL,     // failures to stop or kill a process
+    LOG_CAT_OVERFLOW,   // lost kernel events
+    LOG_CAT_ERROR,      // recoverable errors on the event path
+    LOG_CAT_STATS,      // periodic counters and latency summaries
+    LOG_CAT_COUNT,
+};
+
+int log_start();
+// Write out everything queued and stop the writer.
+void log_stop();
+void log_async(enum log_category, int priority, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_loop.h"
+
+#define LOOP_MAX_EVENTS 16
+
+static void on_signal(struct event_loop *loop, struct loop_source *src) {
+    struct signalfd_siginfo info;
+    while (read(src->fd, &info, sizeof info) == sizeof info) {
+        syslog(LOG_NOTICE, "Received signal %u; shutting down.\n", info.ssi_signo);
+        loop->stop = 1;
+    }
+}
+
+int loop_init(struct event_loop *loop) {
+    int result;
+    memset(loop, 0, sizeof *loop);
+    loop->signals.fd = -1;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        syslog(LOG_ERR, "Unable to create epoll instance: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if ((result = pthread_sigmask(SIG_BLOCK, &mask, &loop->old_mask))) {
+        syslog(LOG_ERR, "Unable to block shutdown signals: %d %s\n", result, strerror(result));
+        close(loop->epoll_fd);
+        return -result;
+    }
+    loop->signals.fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (loop->signals.fd == -1) {
+        result = -errno;
+        syslog(LOG_ERR, "Unable to create signalfd: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    loop->signals.handler = on_signal;
+    if ((result = loop_add(loop, &loop->signals)) < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    loop_destroy(loop);
+    return result;
+}
+
+void loop_destroy(struct event_loop *loop) {
+    if (loop->signals.fd >= 0) {
+        close(loop->signals.fd);
+        loop->signals.fd = -1;
+    }
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+        pthread_sigmask(SIG_SETMASK, &loop->old_mask, NULL);
+    }
+}
+
+int loop_add(struct event_loop *loop, struct loop_source *src) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) == -1) {
+        syslog(LOG_ERR, "Unable to watch fd %d: %d %s\n", src->fd, errno, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+void loop_remove(struct event_loop *loop, struct loop_source *src) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+int loop_add_timer(struct event_loop *loop, struct loop_source *src, long interval_ms) {
+    int result;
+    src->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (src->fd == -1) {
+        syslog(LOG_ERR, "Unable to create timerfd: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(src->fd, 0, &spec, NULL) == -1) {
+        result = -errno;
+        syslog(LOG_ERR, "Unable to arm timerfd: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    if ((result = loop_add(loop, src)) < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(src->fd);
+    src->fd = -1;
+    return result;
+}
+
+uint64_t loop_timer_read(struct loop_source *src) {
+    uint64_t expirations = 0;
+    if (read(src->fd, &expirations, sizeof expirations) == -1) {
+        return 0;
+    }
+    return expirations;
+}
+
+int loop_wait(struct event_loop *loop, int timeout_ms) {
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, evs, LOOP_MAX_EVENTS, timeout_ms);
+    if (count == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        syslog(LOG_ERR, "Recovering from epoll error: %s\n", strerror(errno));
+        return -errno;
+    }
+    int idx;
+    for (idx = 0; idx < count; idx++) {
+        struct loop_source *src = evs[idx].data.ptr;
+        if (src->handler) {
+            src->handler(loop, src);
+        }
+    }
+    return count;
+}
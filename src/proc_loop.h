@@ -0,0 +1,52 @@
+
+// The epoll loop the event processor sleeps in.  Every input it waits on
+// (the event ring, the control socket, taskstats, the eBPF ring buffer, and
+// whatever comes next) is a source with its own handler.  The loop also
+// owns a signalfd, so that SIGTERM and SIGINT end it cleanly instead of
+// killing the process mid-update.
+
+#ifndef __PROC_LOOP_H
+#define __PROC_LOOP_H
+
+#include <signal.h>
+#include <stdint.h>
+
+struct event_loop;
+
+struct loop_source {
+    int fd;
+    // Called when fd is readable; NULL if the wake-up is all that matters.
+    void (*handler)(struct event_loop *, struct loop_source *);
+    void *ctx;
+};
+
+struct event_loop {
+    int epoll_fd;
+    struct loop_source signals;
+    sigset_t old_mask;
+    int stop;               // set once a shutdown signal arrived
+};
+
+// Blocks the shutdown signals for the calling thread and any it creates
+// afterwards, so call it before starting helper threads.
+int loop_init(struct event_loop *);
+void loop_destroy(struct event_loop *);
+
+// The source must stay valid until it is removed or the loop destroyed.
+int loop_add(struct event_loop *, struct loop_source *);
+void loop_remove(struct event_loop *, struct loop_source *);
+// A periodic CLOCK_MONOTONIC timer; the handler should call loop_timer_read.
+// The caller closes src->fd once done with the loop.
+int loop_add_timer(struct event_loop *, struct loop_source *, long interval_ms);
+uint64_t loop_timer_read(struct loop_source *);
+
+// Sleep for at most timeout_ms (-1 for ever) and run the handlers of every
+// ready source.  Returns the number of sources run or -errno.
+int loop_wait(struct event_loop *, int timeout_ms);
+
+// The sooner of two timeouts, either of which may be -1 for none.
+static inline int loop_earliest(int a, int b) {
+    return ((b >= 0) && ((a < 0) || (b < a))) ? b : a;
+}
+
+#endif
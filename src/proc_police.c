@@ -1,6 +1,10 @@
 
-#include <time.h>
+#include "config.h"
+
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -8,6 +12,7 @@
 #include <linux/connector.h>
 #include <linux/filter.h>
 #include <linux/cn_proc.h>
+#include <linux/sock_diag.h>
 
 #include <netinet/in.h>
 
@@ -21,7 +26,22 @@
 #include <stdarg.h>
 #include <syslog.h>
 
+#include "proc_police.h"
 #include "proc_keeper.h"
+#include "proc_source.h"
+#include "proc_latency.h"
+#include "proc_stats.h"
+#include "proc_daemon.h"
+#include "proc_ring.h"
+#include "proc_scan.h"
+#include "proc_taskstats.h"
+#include "proc_loop.h"
+#include "proc_trace.h"
+#include "proc_log.h"
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
 
 int create_filter(int sock) {
     struct sock_filter filter[] = {
@@ -97,6 +117,100 @@ int create_filter(int sock) {
     return 0;
 }
 
+struct loop_stats g_loop_stats;
+
+#define STAT(field) __atomic_load_n(&g_loop_stats.field, __ATOMIC_RELAXED)
+#define STAT_ADD(field, value) __atomic_fetch_add(&g_loop_stats.field, (value), __ATOMIC_RELAXED)
+
+// The receive buffer starts at, and never shrinks below, the 512 KiB it
+// always had, so a burst that fit before still fits before the first
+// overflow.  It doubles on every overflow, up to g_rcvbuf_max, and halves
+// again after RCVBUF_IDLE_TICKS usage ticks without the kernel dropping
+// anything.
+#define RCVBUF_MIN (512*1024)
+#define RCVBUF_IDLE_TICKS 30
+static int g_rcvbuf_max = 16*1024*1024;
+// Size last asked for; the reader grows it, the processor shrinks it.
+static int g_rcvbuf = 0;
+static int g_idle_ticks = 0;
+static unsigned long long g_last_drops = 0;
+
+void set_rcvbuf_max(int size) {
+    g_rcvbuf_max = (size < RCVBUF_MIN) ? RCVBUF_MIN : size;
+}
+
+/**
+ * Ask for a receive buffer of size bytes.  Only root may go past
+ * net.core.rmem_max, and only with SO_RCVBUFFORCE; everyone else is
+ * silently clamped.
+ */
+static int set_rcvbuf(int sock, int size) {
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size)
+            && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size)) {
+        return -errno;
+    }
+    // The kernel doubles the size for its bookkeeping, and reports that.
+    int actual;
+    socklen_t len = sizeof actual;
+    if (!getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &actual, &len)) {
+        __atomic_store_n(&g_loop_stats.rcvbuf, actual / 2, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Swap the receive buffer size from old to size, unless the other thread
+ * got there first.
+ */
+static void resize_rcvbuf(int sock, int old, int size, const char *why) {
+    if (!__atomic_compare_exchange_n(&g_rcvbuf, &old, size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int result;
+    if ((result = set_rcvbuf(sock, size)) < 0) {
+        log_async(LOG_CAT_OVERFLOW, LOG_ERR, "Unable to resize socket buffer to %d KiB: %d %s\n", size / 1024, -result, strerror(-result));
+        return;
+    }
+    log_async(LOG_CAT_OVERFLOW, LOG_INFO, "%s netlink receive buffer to %d KiB.\n", why, size / 1024);
+}
+
+/**
+ * The socket overflowed: double the buffer, up to the ceiling.  Reader
+ * thread only.
+ */
+static void grow_rcvbuf(int sock) {
+    int size = __atomic_load_n(&g_rcvbuf, __ATOMIC_RELAXED);
+    if (size < g_rcvbuf_max) {
+        resize_rcvbuf(sock, size, (size > g_rcvbuf_max / 2) ? g_rcvbuf_max : size * 2, "Grew");
+    }
+}
+
+/**
+ * Once per usage tick: pick up the kernel's drop count and give back
+ * memory once the socket has been quiet for a while.
+ */
+static void tick_rcvbuf(int sock) {
+    // SK_MEMINFO_DROPS counts every datagram the kernel could not queue;
+    // before 4.6 all we have is the number of ENOBUFS seen.
+    __u32 meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof meminfo;
+    unsigned long long drops = STAT(overflows);
+    if (!getsockopt(sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) && (len > SK_MEMINFO_DROPS * sizeof(__u32))) {
+        drops = meminfo[SK_MEMINFO_DROPS];
+        __atomic_store_n(&g_loop_stats.sock_drops, drops, __ATOMIC_RELAXED);
+    }
+    if (drops != g_last_drops) {
+        g_last_drops = drops;
+        g_idle_ticks = 0;
+        return;
+    }
+    int size = __atomic_load_n(&g_rcvbuf, __ATOMIC_RELAXED);
+    if ((++g_idle_ticks >= RCVBUF_IDLE_TICKS) && (size > RCVBUF_MIN)) {
+        g_idle_ticks = 0;
+        resize_rcvbuf(sock, size, (size / 2 < RCVBUF_MIN) ? RCVBUF_MIN : size / 2, "Shrank");
+    }
+}
+
 /**
  *  This borrows ideas and code (where possible) from:
  *    http://netsplit.com/2011/02/09/the-proc-connector-and-socket-filters/
@@ -132,10 +246,10 @@ int create_socket() {
         return -errno;
     }
 
-    unsigned int socket_size = 512*1024;
-    if (setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &socket_size, sizeof(int))) {
-        syslog(LOG_ERR, "Unable to increase socket buffer size: %d %s\n", errno, strerror(errno));
-        return -errno;
+    g_rcvbuf = RCVBUF_MIN;
+    if ((result = set_rcvbuf(sock, g_rcvbuf)) < 0) {
+        syslog(LOG_ERR, "Unable to set socket buffer size: %d %s\n", -result, strerror(-result));
+        return result;
     }
 
     return sock;
@@ -185,109 +299,473 @@ int inform_kernel(int sock, enum proc_cn_mcast_op op) {
     return 0;
 }
 
-int message_loop(int sock) {
-
-    struct msghdr msghdr;
-    struct sockaddr_nl addr;
-    struct iovec iov[1];
-    char buf[getpagesize()];
-    ssize_t len;
+int netlink_pause(int sock) {
+    int group = CN_IDX_PROC;
+    if (setsockopt(sock, SOL_NETLINK, NETLINK_DROP_MEMBERSHIP, &group, sizeof group) == -1) {
+        syslog(LOG_ERR, "Unable to leave the proc connector group: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
 
-    msghdr.msg_name = &addr;
-    msghdr.msg_namelen = sizeof addr;
-    msghdr.msg_iov = iov;
-    msghdr.msg_iovlen = 1;
-    msghdr.msg_control = NULL;
-    msghdr.msg_controllen = 0;
-    msghdr.msg_flags = 0;
+int netlink_resume(int sock) {
+    // Whatever arrived before the pause is about processes nobody tracks.
+    char buf[4096];
+    while ((recv(sock, buf, sizeof buf, MSG_DONTWAIT) >= 0) || (errno == ENOBUFS) || (errno == EINTR)) {}
+    int group = CN_IDX_PROC;
+    if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof group) == -1) {
+        syslog(LOG_ERR, "Unable to rejoin the proc connector group: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
 
-    iov[0].iov_base = buf;
-    iov[0].iov_len = sizeof buf;
+void log_loop_stats() {
+    unsigned long long events = STAT(events), batches = STAT(batches);
+    if (!events || !batches) {
+        return;
+    }
+    log_async(LOG_CAT_STATS, LOG_INFO, "Received %llu events in %llu datagrams using %llu syscalls "
+        "(%.3f syscalls/event, mean batch %.1f, max batch %llu, %llu overflows); "
+        "applied %llu, ring high water %llu of %u, %llu ring drops, %llu resyncs; "
+        "receive buffer %llu KiB, %llu datagrams dropped by the kernel\n",
+        events, STAT(datagrams), STAT(syscalls),
+        (double)STAT(syscalls) / events,
+        (double)STAT(datagrams) / batches,
+        STAT(max_batch), STAT(overflows),
+        STAT(applied), STAT(ring_high_water), EVENT_RING_SIZE, STAT(ring_drops), STAT(resyncs),
+        STAT(rcvbuf) / 1024, STAT(sock_drops));
+}
 
+/**
+ * Copy the fork and exit events out of one proc connector datagram into
+ * the ring.  Returns -1 if the datagram was not from the proc connector.
+ */
+static int queue_datagram(char *buf, ssize_t len, struct event_ring *ring, int *lost) {
     struct nlmsghdr *nlmsghdr;
+    for (nlmsghdr = (struct nlmsghdr *)buf;
+            NLMSG_OK (nlmsghdr, len);
+             nlmsghdr = NLMSG_NEXT (nlmsghdr, len)) {
+
+        if ((nlmsghdr->nlmsg_type == NLMSG_ERROR) 
+                || (nlmsghdr->nlmsg_type == NLMSG_NOOP)) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Ignoring message due to error.\n");
+            continue;
+        }
 
-    // Periodically timeout the socket
-    struct timeval timeout;      
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-    // Ignore the return code.  If we can't set the timeout, we just drop the CPU usage.
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        struct cn_msg *cn_msg = NLMSG_DATA (nlmsghdr);
+        if ((cn_msg->id.idx != CN_IDX_PROC)
+                 || (cn_msg->id.val != CN_VAL_PROC)) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Impossible message! %d.%d\n", cn_msg->id.idx, cn_msg->id.val);
+            return -1;
+        }
 
-    struct timespec last_ts;
-    clock_gettime(CLOCK_MONOTONIC, &last_ts);
-    while (1) {
+        struct proc_event *ev = (struct proc_event *)cn_msg->data;
 
-        // If we think we are done, clear out the queued messages, then exit.
-        len = recvmsg (sock, &msghdr, is_done() ? MSG_DONTWAIT : 0);
+        switch (ev->what) {
 
-        if (len == -1) {
-            if (is_done() && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                // is_done was true, and we don't have any messages in the queue.
+            case PROC_EVENT_FORK:
+                if (ev->event_data.fork.child_tgid == ev->event_data.fork.child_pid) {
+                    STAT_ADD(events, 1);
+                    if (event_ring_push(ring, ev)) {
+                        *lost = 1;
+                    }
+                }
                 break;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                processUsage();
-                clock_gettime(CLOCK_MONOTONIC, &last_ts);
-            } else if (errno == ENOBUFS) {
-                syslog(LOG_ERR, "OVERFLOW (socket buffer overflow; likely fork bomb attack)");
-            } else {
-                syslog(LOG_ERR, "Recovering from recvmsg error: %s\n", strerror(errno));
-            }
-            continue;
+            case PROC_EVENT_EXIT:
+                if (ev->event_data.exit.process_tgid == ev->event_data.exit.process_pid) {
+                    STAT_ADD(events, 1);
+                    if (event_ring_push(ring, ev)) {
+                        *lost = 1;
+                    }
+                }
+                break;
+            default:
+                break; // Likely, the BPF isn't working correctly.
         }
+    }
+    return 0;
+}
+
+// Resync markers queued but not yet reached by the processor.  Only the
+// last one needs a /proc scan, so an overflow storm costs one scan rather
+// than one per ENOBUFS.
+static unsigned int g_markers_queued = 0;
+// Ring position just after the newest marker; reader thread only.
+static unsigned int g_marker_end = 0;
+
+static void dispatch_event(const struct proc_event *ev, uint64_t now) {
+    switch (ev->what) {
+        case PROC_EVENT_FORK:
+            latency_record(&g_latency.dispatch, (now > ev->timestamp_ns) ? now - ev->timestamp_ns : 0);
+            //syslog(LOG_DEBUG, "DFORK: %d -> %d\n", ev->event_data.fork.parent_tgid, ev->event_data.fork.child_tgid);
+            trace_event(ev->what, ev->cpu, ev->timestamp_ns, ev->event_data.fork.child_tgid, ev->event_data.fork.parent_tgid);
+            processFork(ev->event_data.fork.parent_tgid, ev->event_data.fork.child_tgid);
+            break;
+        case PROC_EVENT_EXIT:
+            latency_record(&g_latency.dispatch, (now > ev->timestamp_ns) ? now - ev->timestamp_ns : 0);
+            //syslog(LOG_DEBUG, "DEXIT: %d\n", ev->event_data.exit.process_tgid);
+            trace_event(ev->what, ev->cpu, ev->timestamp_ns, ev->event_data.exit.process_tgid, 0);
+            processExit(ev->event_data.exit.process_tgid, ev->timestamp_ns);
+            break;
+        case PROC_EVENT_NONE:
+            // Events queued behind a later marker are replayed after this
+            // scan, so only that marker's scan is any use.
+            if ((ev->event_data.ack.err == ENOBUFS)
+                    && !__atomic_sub_fetch(&g_markers_queued, 1, __ATOMIC_SEQ_CST)) {
+                STAT_ADD(resyncs, 1);
+                proc_resync();
+            }
+            break;
+        default:
+            break;
+    }
+}
 
-        struct timespec ts;
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        int diff = (ts.tv_sec - last_ts.tv_sec) * 1000;
-        diff += (ts.tv_nsec - last_ts.tv_nsec) / 1e6;
-        if (diff >= 10*1000) {
-            processUsage();
-            clock_gettime(CLOCK_MONOTONIC, &last_ts);
+/**
+ * Events have been lost, either in the kernel or because the ring was full.
+ * Queue a marker behind everything received so far; when the processor
+ * reaches it, it rebuilds the trees from /proc.  Returns 0 once queued.
+ */
+static int queue_resync(struct event_ring *ring) {
+    // A marker covers losses up to the point it was queued.  Events queued
+    // after it are replayed after its scan, so a stale fork whose exit was
+    // lost would be adopted for good: a later loss needs a later marker,
+    // unless nothing has been queued since.
+    if (__atomic_load_n(&g_markers_queued, __ATOMIC_SEQ_CST) && (ring->pending == g_marker_end)) {
+        return 0;
+    }
+    struct proc_event marker;
+    memset(&marker, 0, sizeof marker);
+    marker.what = PROC_EVENT_NONE;
+    marker.event_data.ack.err = ENOBUFS;
+    // Counted before publishing, so the processor never sees the marker
+    // without the count.
+    __atomic_add_fetch(&g_markers_queued, 1, __ATOMIC_SEQ_CST);
+    if (event_ring_push(ring, &marker)) {
+        __atomic_sub_fetch(&g_markers_queued, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    g_marker_end = ring->pending;
+    return 0;
+}
+
+struct reader_args {
+    int sock;
+    int kernel;
+    int stop_fd;
+    int stopping;
+    struct event_ring *ring;
+    int result;
+};
+
+/**
+ * The netlink reader thread.  It does nothing but keep the socket empty:
+ * datagrams are drained MESSAGE_BATCH at a time with recvmmsg and their
+ * events copied into the ring.  All tree bookkeeping, /proc sampling and
+ * killing happens on the processor side, so none of it can make the kernel
+ * queue overflow.
+ */
+static void *reader_main(void *arg) {
+    struct reader_args *args = arg;
+    struct event_ring *ring = args->ring;
+    size_t page_size = getpagesize();
+    struct mmsghdr msgs[MESSAGE_BATCH];
+    struct sockaddr_nl addrs[MESSAGE_BATCH];
+    struct iovec iovs[MESSAGE_BATCH];
+    int lost = 0;
+    // After an overrun the kernel drops further events silently until we
+    // have emptied the socket, so the marker must wait until then.
+    int congested = 0;
+    char *bufs = malloc(MESSAGE_BATCH * page_size);
+    if (!bufs) {
+        syslog(LOG_ERR, "Unable to allocate receive buffers.\n");
+        __atomic_store_n(&args->result, -ENOMEM, __ATOMIC_RELEASE);
+        goto finished;
+    }
+    int idx;
+    for (idx = 0; idx < MESSAGE_BATCH; idx++) {
+        iovs[idx].iov_base = bufs + idx * page_size;
+        iovs[idx].iov_len = page_size;
+    }
+
+    // A socket that never runs dry would keep us from ever polling stop_fd.
+    while (!__atomic_load_n(&args->stopping, __ATOMIC_ACQUIRE)) {
+        // recvmmsg overwrites the lengths on every call.
+        for (idx = 0; idx < MESSAGE_BATCH; idx++) {
+            memset(&msgs[idx].msg_hdr, 0, sizeof msgs[idx].msg_hdr);
+            msgs[idx].msg_hdr.msg_name = &addrs[idx];
+            msgs[idx].msg_hdr.msg_namelen = sizeof addrs[idx];
+            msgs[idx].msg_hdr.msg_iov = &iovs[idx];
+            msgs[idx].msg_hdr.msg_iovlen = 1;
         }
 
-        if (addr.nl_pid != 0) {
+        int count = recvmmsg (args->sock, msgs, MESSAGE_BATCH, MSG_DONTWAIT, NULL);
+        STAT_ADD(syscalls, 1);
+
+        if (count == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                congested = 0;
+                if (lost && !queue_resync(ring)) {
+                    lost = 0;
+                    event_ring_publish(ring);
+                }
+                // Queue is empty: sleep until the kernel or the processor
+                // (asking us to stop) wakes us.  If the ring had no room
+                // for the marker, retry shortly.
+                struct pollfd fds[2];
+                fds[0].fd = args->sock;
+                fds[0].events = POLLIN;
+                fds[1].fd = args->stop_fd;
+                fds[1].events = POLLIN;
+                if ((poll(fds, 2, lost ? 10 : -1) == -1) && (errno != EINTR)) {
+                    log_async(LOG_CAT_ERROR, LOG_ERR, "Recovering from poll error: %s\n", strerror(errno));
+                }
+                if (fds[1].revents & POLLIN) {
+                    break;
+                }
+            } else if (errno == ENOBUFS) {
+                STAT_ADD(overflows, 1);
+                log_async(LOG_CAT_OVERFLOW, LOG_ERR, "OVERFLOW (socket buffer overflow; likely fork bomb attack)");
+                lost = 1;
+                congested = 1;
+                grow_rcvbuf(args->sock);
+            } else if (errno != EINTR) {
+                log_async(LOG_CAT_ERROR, LOG_ERR, "Recovering from recvmmsg error: %s\n", strerror(errno));
+            }
             continue;
         }
 
-        for (nlmsghdr = (struct nlmsghdr *)buf;
-                NLMSG_OK (nlmsghdr, len);
-                 nlmsghdr = NLMSG_NEXT (nlmsghdr, len)) {
+        STAT_ADD(batches, 1);
+        STAT_ADD(datagrams, count);
+        if ((unsigned long long)count > g_loop_stats.max_batch) {
+            __atomic_store_n(&g_loop_stats.max_batch, count, __ATOMIC_RELAXED);
+        }
 
-            if ((nlmsghdr->nlmsg_type == NLMSG_ERROR) 
-                    || (nlmsghdr->nlmsg_type == NLMSG_NOOP)) {
-                syslog(LOG_ERR, "Ignoring message due to error.\n");
+        for (idx = 0; idx < count; idx++) {
+            // Anyone may send to a netlink socket; only the kernel's count.
+            if (args->kernel && (addrs[idx].nl_pid != 0)) {
                 continue;
             }
-
-            struct cn_msg *cn_msg = NLMSG_DATA (nlmsghdr);
-            if ((cn_msg->id.idx != CN_IDX_PROC)
-                     || (cn_msg->id.val != CN_VAL_PROC)) {
-                syslog(LOG_ERR, "Impossible message! %d.%d\n", cn_msg->id.idx, cn_msg->id.val);
-                return -1;
+            if (queue_datagram(iovs[idx].iov_base, msgs[idx].msg_len, ring, &lost) < 0) {
+                __atomic_store_n(&args->result, -1, __ATOMIC_RELEASE);
+                goto finished;
             }
+        }
+        // A short batch means the socket is empty.
+        if (count < MESSAGE_BATCH) {
+            congested = 0;
+        }
+        if (lost && !congested && !queue_resync(ring)) {
+            lost = 0;
+        }
+        event_ring_publish(ring);
+        __atomic_store_n(&g_loop_stats.ring_high_water, ring->high_water, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_loop_stats.ring_drops, __atomic_load_n(&ring->drops, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
 
-            struct proc_event *ev = (struct proc_event *)cn_msg->data;
+finished:
+    event_ring_publish(ring);
+    if (args->result < 0) {
+        // Wake the processor so it notices the reader has given up.
+        uint64_t one = 1;
+        if (write(ring->efd, &one, sizeof one) == -1) {}
+    }
+    free(bufs);
+    return NULL;
+}
 
-            switch (ev->what) {
+static void on_registration(struct event_loop *loop, struct loop_source *src) {
+    handle_registration(loop, src->fd);
+}
 
-                case PROC_EVENT_FORK:
-                    if (ev->event_data.fork.child_tgid == ev->event_data.fork.child_pid) {
-                        //syslog(LOG_DEBUG, "DFORK: %d -> %d\n", ev->event_data.fork.parent_tgid, ev->event_data.fork.child_tgid);
-                        processFork(ev->event_data.fork.parent_tgid, ev->event_data.fork.child_tgid);
-                    }
-                    break;
-                case PROC_EVENT_EXIT:
-                    if (ev->event_data.exit.process_tgid == ev->event_data.exit.process_pid) {
-                        //syslog(LOG_DEBUG, "DEXIT: %d\n", ev->event_data.exit.process_tgid);
-                        processExit(ev->event_data.exit.process_tgid);
-                    }
-                    break;
-                default:
-                    break; // Likely, the BPF isn't working correctly.
+// Exits of untracked processes must not pile up until the next batch of
+// events.
+static void on_taskstats(struct event_loop *loop, struct loop_source *src) {
+    taskstats_drain();
+}
+
+// A watched or trigger process is gone: start its teardown now, ahead of
+// whatever is still queued.
+static void on_watch(struct event_loop *loop, struct loop_source *src) {
+    processWatchReady();
+}
+
+static unsigned int g_taskstats_threshold = 0;
+
+void set_taskstats_threshold(unsigned int pids) {
+    g_taskstats_threshold = pids;
+}
+
+void taskstats_grow(struct event_loop *loop, struct loop_source *src) {
+    if (!g_taskstats_threshold || (src->fd >= 0)) {
+        return;
+    }
+    if (tracked_pids() <= g_taskstats_threshold) {
+        return;
+    }
+    // One attempt; without taskstats, sampling carries on as it was.
+    g_taskstats_threshold = 0;
+    if (taskstats_open() < 0) {
+        return;
+    }
+    src->fd = taskstats_fd();
+    if (loop_add(loop, src) < 0) {
+        taskstats_close();
+        src->fd = -1;
+    }
+}
+
+struct tick_args {
+    const struct event_source *events;
+    int ctl_sock;
+    struct loop_source *taskstats;
+};
+
+int usage_step() {
+    int due = processUsageDue();
+    if (due != 0) {
+        return due;
+    }
+    trace_usage();
+    uint64_t start = now_ns();
+    processUsage();
+    stats_sampled(now_ns() - start);
+    return processUsageDue();
+}
+
+static void on_tick(struct event_loop *loop, struct loop_source *src) {
+    struct tick_args *args = src->ctx;
+    loop_timer_read(src);
+    taskstats_grow(loop, args->taskstats);
+    if (args->events->kernel) {
+        tick_rcvbuf(args->events->fd);
+    }
+    stats_publish(1);
+    if (args->ctl_sock >= 0) {
+        log_loop_stats();
+        log_latency();
+    }
+}
+
+/**
+ * Process events from `events` until every tracked tree is finished, or
+ * until we are told to shut down.
+ *
+ * If ctl_sock is valid, we are running as the shared daemon: the loop never
+ * finishes on its own, accepts new registrations on ctl_sock and reaps trees
+ * as they complete.
+ *
+ * A dedicated reader thread drains the socket into a ring; this thread owns
+ * the trees and applies events, samples usage and kills processes.  It
+ * sleeps in epoll and only wakes for events, registrations, exit
+ * accounting, the housekeeping timer, usage passes and teardown steps.
+ */
+int message_loop(const struct event_source *events, int ctl_sock) {
+
+    const long interval = 10*1000;
+    int result = 0;
+    struct event_ring ring;
+    struct proc_event evs[MESSAGE_BATCH];
+    struct reader_args args;
+    pthread_t reader;
+    struct event_loop loop;
+    struct loop_source ring_src = {-1, NULL, NULL};
+    struct loop_source ctl_src = {ctl_sock, on_registration, NULL};
+    struct loop_source taskstats_src = {taskstats_fd(), on_taskstats, NULL};
+    struct loop_source watch_src = {processWatchFd(), on_watch, NULL};
+    struct tick_args tick_args = {events, ctl_sock, &taskstats_src};
+    struct loop_source tick_src = {-1, on_tick, &tick_args};
+
+    if ((result = event_ring_init(&ring, EVENT_RING_SIZE)) < 0) {
+        return result;
+    }
+    // Before the reader starts, so it inherits the blocked signals.
+    if ((result = loop_init(&loop)) < 0) {
+        event_ring_destroy(&ring);
+        return result;
+    }
+    ring_src.fd = ring.efd;
+    if (((result = loop_add(&loop, &ring_src)) < 0)
+            || ((ctl_sock >= 0) && ((result = loop_add(&loop, &ctl_src)) < 0))
+            || ((taskstats_src.fd >= 0) && ((result = loop_add(&loop, &taskstats_src)) < 0))
+            || ((watch_src.fd >= 0) && ((result = loop_add(&loop, &watch_src)) < 0))
+            || ((result = loop_add_timer(&loop, &tick_src, interval)) < 0)) {
+        loop_destroy(&loop);
+        event_ring_destroy(&ring);
+        return result;
+    }
+    args.sock = events->fd;
+    args.kernel = events->kernel;
+    args.ring = &ring;
+    args.result = 0;
+    args.stopping = 0;
+    args.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (args.stop_fd == -1) {
+        syslog(LOG_ERR, "Unable to create eventfd: %d %s\n", errno, strerror(errno));
+        result = -errno;
+        goto cleanup;
+    }
+    if ((result = pthread_create(&reader, NULL, reader_main, &args))) {
+        syslog(LOG_ERR, "Unable to start reader thread: %d %s\n", result, strerror(result));
+        close(args.stop_fd);
+        result = -result;
+        goto cleanup;
+    }
+
+    while (!loop.stop) {
+
+        unsigned int count, idx;
+        while ((count = event_ring_pop(&ring, evs, MESSAGE_BATCH))) {
+            // The kernel reports the exit accounting of a process before
+            // its exit event, so this picks it up for every exit popped.
+            taskstats_drain();
+            // One clock read per batch; applying a batch takes microseconds.
+            uint64_t now = now_ns();
+            for (idx = 0; idx < count; idx++) {
+                dispatch_event(&evs[idx], now);
             }
+            STAT_ADD(applied, count);
+            // Behind a backlog, a head process exit must not wait its turn.
+            processWatchReady();
+            stats_publish(0);
+        }
+
+        if (ctl_sock >= 0) {
+            reap_trees();
+        } else if (is_done()) {
+            break;
+        }
+        if (__atomic_load_n(&args.result, __ATOMIC_ACQUIRE) < 0) {
+            result = args.result;
+            break;
         }
 
+        if (!event_ring_prepare_sleep(&ring)) {
+            continue;
+        }
+        // Wake up in time to move stopping trees along, to publish what
+        // the last events changed, and for the next usage pass.
+        int timeout = loop_earliest(processTeardown(), stats_publish(0));
+        loop_wait(&loop, loop_earliest(timeout, usage_step()));
+        seed_registered();
+        event_ring_wake(&ring);
     }
 
-    return 0;
-}
+    uint64_t one = 1;
+    __atomic_store_n(&args.stopping, 1, __ATOMIC_RELEASE);
+    if (write(args.stop_fd, &one, sizeof one) != sizeof one) {
+        syslog(LOG_ERR, "Unable to stop reader thread: %d %s\n", errno, strerror(errno));
+    }
+    pthread_join(reader, NULL);
+    close(args.stop_fd);
+    log_loop_stats();
 
+cleanup:
+    if (tick_src.fd >= 0) {
+        close(tick_src.fd);
+    }
+    loop_destroy(&loop);
+    event_ring_destroy(&ring);
+    return result;
+}
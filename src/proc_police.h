@@ -5,5 +5,46 @@
 int create_filter(int sock);
 int create_socket();
 int inform_kernel(int, enum proc_cn_mcast_op);
-int message_loop(int);
+// Stop and restart delivery to a subscribed socket, for monitors waiting in
+// the pool: while paused, the socket costs nothing however busy the node.
+int netlink_pause(int);
+int netlink_resume(int);
+struct event_source;
+int message_loop(const struct event_source *, int);
+void log_loop_stats();
+// A private monitor subscribes to taskstats only once its trees hold more
+// than `pids` processes, as every subscriber is woken for every exit on the
+// node; 0, the default, never subscribes from the loop.
+#define TASKSTATS_MONITOR_PIDS 64
+void set_taskstats_threshold(unsigned int pids);
+struct event_loop;
+struct loop_source;
+// Called from the housekeeping tick; adds src to loop once subscribed.
+void taskstats_grow(struct event_loop *, struct loop_source *src);
+// Run a usage pass if one is due; returns the milliseconds until the next,
+// or -1 if none is.  Event loops call it before they sleep.
+int usage_step();
+// Ceiling, in bytes, for the netlink receive buffer to grow to.
+void set_rcvbuf_max(int);
+
+// Datagrams drained from the netlink socket per recvmmsg call.
+#define MESSAGE_BATCH 64
+
+// Counters describing how efficiently message_loop drains the socket.
+// The reader thread writes them; read them with __atomic_load_n.
+struct loop_stats {
+    unsigned long long syscalls;   // recvmmsg calls, including empty ones
+    unsigned long long batches;    // recvmmsg calls that returned data
+    unsigned long long datagrams;
+    unsigned long long events;     // fork/exit events handed to the ring
+    unsigned long long max_batch;
+    unsigned long long overflows;  // ENOBUFS
+    unsigned long long applied;    // events applied to the trees
+    unsigned long long ring_high_water;
+    unsigned long long ring_drops; // events lost because the ring was full
+    unsigned long long resyncs;    // /proc rescans after lost events
+    unsigned long long rcvbuf;     // receive buffer granted, in bytes
+    unsigned long long sock_drops; // datagrams the kernel dropped, cumulative
+};
+extern struct loop_stats g_loop_stats;
 
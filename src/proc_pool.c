@@ -0,0 +1,285 @@
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_pool.h"
+#include "proc_loop.h"
+
+// How often empty slots are refilled, if a monitor died before it was
+// claimed; a monitor that cannot subscribe must not make us fork in a loop.
+#define POOL_REFILL_MS 1000
+
+struct standby {
+    struct loop_source src;  // our end of the hand-over channel; -1 if empty
+    pid_t pid;
+};
+
+static struct standby g_pool[POOL_MAX];
+static unsigned int g_pool_size = 0;
+static int g_ctl_sock = -1;
+static standby_main_t g_standby = NULL;
+static struct event_loop *g_loop = NULL;
+static struct loop_source g_refill = {-1, NULL, NULL};
+
+static void on_standby_exit(struct event_loop *loop, struct loop_source *src);
+
+static void clear_slot(struct standby *slot) {
+    loop_remove(g_loop, &slot->src);
+    close(slot->src.fd);
+    slot->src.fd = -1;
+    slot->pid = 0;
+}
+
+/**
+ * Fork a monitor into an empty slot.  The child has no use for anything of
+ * ours but its end of the channel.
+ */
+static int spawn_standby(struct standby *slot) {
+    int chan[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, chan) == -1) {
+        syslog(LOG_ERR, "Unable to create hand-over channel: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        syslog(LOG_ERR, "Unable to fork an idle monitor: %d %s\n", errno, strerror(errno));
+        close(chan[0]);
+        close(chan[1]);
+        return -errno;
+    }
+    if (pid == 0) {
+        close(chan[0]);
+        close(g_ctl_sock);
+        if (g_refill.fd >= 0) {
+            close(g_refill.fd);
+        }
+        unsigned int idx;
+        for (idx = 0; idx < g_pool_size; idx++) {
+            if (g_pool[idx].src.fd >= 0) {
+                close(g_pool[idx].src.fd);
+            }
+        }
+        loop_destroy(g_loop);
+        signal(SIGCHLD, SIG_DFL);
+        exit(g_standby(chan[1]));
+    }
+    close(chan[1]);
+    slot->src.fd = chan[0];
+    slot->src.handler = on_standby_exit;
+    slot->src.ctx = slot;
+    slot->pid = pid;
+    int result;
+    if ((result = loop_add(g_loop, &slot->src)) < 0) {
+        // Closing the channel stops it.
+        close(slot->src.fd);
+        slot->src.fd = -1;
+        slot->pid = 0;
+        return result;
+    }
+    return 0;
+}
+
+static void refill() {
+    unsigned int idx;
+    for (idx = 0; idx < g_pool_size; idx++) {
+        if ((g_pool[idx].src.fd < 0) && (spawn_standby(&g_pool[idx]) < 0)) {
+            return;
+        }
+    }
+}
+
+/**
+ * An idle monitor only ever closes its end of the channel: it died.
+ */
+static void on_standby_exit(struct event_loop *loop, struct loop_source *src) {
+    struct standby *slot = src->ctx;
+    // The slot may have been handed out, and refilled, earlier in the same
+    // wake-up.
+    char byte;
+    if ((src->fd < 0) || (recv(src->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != 0)) {
+        return;
+    }
+    syslog(LOG_WARNING, "Idle monitor %d exited before it was claimed.\n", slot->pid);
+    clear_slot(slot);
+}
+
+static void on_refill(struct event_loop *loop, struct loop_source *src) {
+    loop_timer_read(src);
+    refill();
+}
+
+/**
+ * Pass the connection to an idle monitor.  Returns 0 once one has it.
+ */
+static int hand_over(struct standby *slot, int conn) {
+    struct msghdr msghdr;
+    struct iovec iov[1];
+    char byte = 0;
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    memset(&msghdr, 0, sizeof msghdr);
+    iov[0].iov_base = &byte;
+    iov[0].iov_len = 1;
+    msghdr.msg_iov = iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsgbuf;
+    msghdr.msg_controllen = sizeof cmsgbuf;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &conn, sizeof(int));
+    if (sendmsg(slot->src.fd, &msghdr, MSG_NOSIGNAL) != 1) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void on_connection(struct event_loop *loop, struct loop_source *src) {
+    int conn = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        if ((errno != EAGAIN) && (errno != EINTR) && (errno != ECONNABORTED)) {
+            syslog(LOG_ERR, "Unable to accept on control socket: %d %s\n", errno, strerror(errno));
+        }
+        return;
+    }
+    // The first idle monitor that is still alive takes it.
+    unsigned int idx;
+    int result = -ENOENT;
+    for (idx = 0; (idx < g_pool_size) && (result < 0); idx++) {
+        struct standby *slot = &g_pool[idx];
+        if (slot->src.fd < 0) {
+            continue;
+        }
+        pid_t pid = slot->pid;
+        if ((result = hand_over(slot, conn)) == 0) {
+            syslog(LOG_DEBUG, "Handed registration to idle monitor %d.\n", pid);
+        }
+        clear_slot(slot);
+    }
+    // A burst has used them all up: start one for this payload alone.  It
+    // picks the connection up once it has subscribed.
+    for (idx = 0; (idx < g_pool_size) && (result < 0); idx++) {
+        struct standby *slot = &g_pool[idx];
+        if ((slot->src.fd >= 0) || (spawn_standby(slot) < 0)) {
+            continue;
+        }
+        result = hand_over(slot, conn);
+        clear_slot(slot);
+    }
+    if (result < 0) {
+        syslog(LOG_ERR, "No monitor available to take a registration: %d %s\n", -result, strerror(-result));
+    }
+    close(conn);
+    refill();
+}
+
+int pool_run(int ctl_sock, unsigned int size, standby_main_t standby) {
+    int result;
+    struct event_loop loop;
+    struct loop_source ctl_src = {ctl_sock, on_connection, NULL};
+
+    g_pool_size = (size > POOL_MAX) ? POOL_MAX : size;
+    if (!g_pool_size) {
+        g_pool_size = 1;
+    }
+    g_ctl_sock = ctl_sock;
+    g_standby = standby;
+    g_loop = &loop;
+    unsigned int idx;
+    for (idx = 0; idx < g_pool_size; idx++) {
+        g_pool[idx].src.fd = -1;
+        g_pool[idx].pid = 0;
+    }
+    // Claimed monitors live on as our children; never leave them zombies.
+    signal(SIGCHLD, SIG_IGN);
+
+    if ((result = loop_init(&loop)) < 0) {
+        return result;
+    }
+    if (((result = loop_add(&loop, &ctl_src)) < 0)
+            || ((result = loop_add_timer(&loop, &g_refill, POOL_REFILL_MS)) < 0)) {
+        goto cleanup;
+    }
+    g_refill.handler = on_refill;
+    refill();
+
+    while (!loop.stop) {
+        if ((result = loop_wait(&loop, -1)) < 0) {
+            break;
+        }
+        result = 0;
+    }
+
+cleanup:
+    // An idle monitor stops once its channel is closed.
+    for (idx = 0; idx < g_pool_size; idx++) {
+        if (g_pool[idx].src.fd >= 0) {
+            clear_slot(&g_pool[idx]);
+        }
+    }
+    if (g_refill.fd >= 0) {
+        close(g_refill.fd);
+        g_refill.fd = -1;
+    }
+    loop_destroy(&loop);
+    g_loop = NULL;
+    return result;
+}
+
+int pool_claim(int chan) {
+    int result;
+    struct event_loop loop;
+    struct loop_source chan_src = {chan, NULL, NULL};
+
+    if ((result = loop_init(&loop)) < 0) {
+        return result;
+    }
+    if ((result = loop_add(&loop, &chan_src)) < 0) {
+        goto cleanup;
+    }
+    while (!loop.stop && ((result = loop_wait(&loop, -1)) == 0)) {}
+    if (loop.stop) {
+        result = -ECANCELED;
+        goto cleanup;
+    } else if (result < 0) {
+        goto cleanup;
+    }
+
+    struct msghdr msghdr;
+    struct iovec iov[1];
+    char byte;
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    memset(&msghdr, 0, sizeof msghdr);
+    iov[0].iov_base = &byte;
+    iov[0].iov_len = 1;
+    msghdr.msg_iov = iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsgbuf;
+    msghdr.msg_controllen = sizeof cmsgbuf;
+    ssize_t len;
+    while (((len = recvmsg(chan, &msghdr, MSG_CMSG_CLOEXEC)) < 0) && errno == EINTR) {}
+    if (len <= 0) {
+        // The pool closed the channel: it is shutting down.
+        result = (len == 0) ? -ECANCELED : -errno;
+        goto cleanup;
+    }
+    result = -EPROTO;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr);
+    if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)
+            && (cmsg->cmsg_len == CMSG_LEN(sizeof(int)))) {
+        memcpy(&result, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+cleanup:
+    loop_destroy(&loop);
+    return result;
+}
@@ -0,0 +1,36 @@
+
+// A pool of idle monitors, each already subscribed to the kernel feed,
+// handed out to payloads as they register.  The pool speaks the daemon's
+// registration protocol on the control socket, so the plugin's -socket
+// option works with either.  A claimed monitor tracks its one payload, like
+// a private monitor, while the pool starts a replacement in the background.
+
+#ifndef __PROC_POOL_H
+#define __PROC_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POOL_MAX 64
+
+// Runs in each new monitor, which is forked from the pool: subscribe, call
+// pool_claim, then track the payload it hands over.  The return value is
+// the monitor's exit code.
+typedef int (*standby_main_t)(int chan);
+
+// Keep `size` idle monitors and hand each connection on ctl_sock to one of
+// them, until SIGTERM or SIGINT.  Idle monitors are stopped on the way out;
+// claimed ones carry on.
+int pool_run(int ctl_sock, unsigned int size, standby_main_t standby);
+
+// In an idle monitor: wait until the pool hands over a registration.
+// Returns the connection, or a negative errno once the pool is shutting
+// down (-ECANCELED) or gone.
+int pool_claim(int chan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
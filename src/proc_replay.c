@@ -0,0 +1,264 @@
+
+/**
+ * Feed a trace recorded with `process-tracking --trace <file>` back through
+ * the trees, as fast as they will take it, and report the rate and the
+ * state the trees end up in.  Needs neither root nor the proc connector.
+ *
+ * Every pid but 0 and 1 is moved above PID_MAX_LIMIT, as in the benchmarks,
+ * so that teardowns replayed from another node can never signal a real
+ * process.  Usage ticks sample nothing for the same reason, and exit
+ * accounting from taskstats is not part of the trace.
+ *
+ * With -l, the fork and exit events are instead sent as proc connector
+ * datagrams, at the given rate (0 for flat out), through the monitor's own
+ * message loop: reader thread, ring and all.
+ */
+
+#include "config.h"
+
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <linux/cn_proc.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_keeper.h"
+#include "proc_scan.h"
+#include "proc_trace.h"
+#include "proc_police.h"
+#include "proc_source.h"
+#include "proc_latency.h"
+#include "proc_util.h"
+
+struct replay_counts {
+    unsigned long long forks;
+    unsigned long long exits;
+    unsigned long long registrations;
+    unsigned long long ticks;
+    unsigned long long resyncs;
+    unsigned long long unknown;
+};
+
+/**
+ * Apply every record of the trace, in order, the way the monitor or daemon
+ * that recorded it did.
+ */
+static int replay(const struct trace_file *trace, struct replay_counts *counts) {
+    struct proc_snapshot snap;
+    uint64_t idx;
+    int result = 0;
+
+    memset(&snap, 0, sizeof snap);
+    memset(counts, 0, sizeof *counts);
+    for (idx = 0; idx < trace->count; idx++) {
+        const struct trace_record *rec = &trace->records[idx];
+        switch (rec->what) {
+            case PROC_EVENT_FORK:
+                processFork(fake_pid(rec->ppid), fake_pid(rec->pid));
+                counts->forks++;
+                break;
+            case PROC_EVENT_EXIT:
+                processExit(fake_pid(rec->pid), 0);
+                // As the daemon does once per wake-up.
+                reap_trees();
+                counts->exits++;
+                break;
+            case TRACE_REGISTER:
+                register_tree(fake_pid(rec->pid), fake_pid(rec->ppid), -1, NULL, NULL);
+                counts->registrations++;
+                break;
+            case TRACE_USAGE:
+                processUsage();
+                processTeardown();
+                counts->ticks++;
+                break;
+            case TRACE_SNAPSHOT:
+                if ((result = proc_snapshot_add(&snap, fake_pid(rec->pid), fake_pid(rec->ppid))) < 0) {
+                    goto cleanup;
+                }
+                break;
+            case TRACE_RESYNC:
+                processResync(&snap);
+                reap_trees();
+                snap.count = 0;
+                counts->resyncs++;
+                break;
+            default:
+                counts->unknown++;
+                break;
+        }
+    }
+
+cleanup:
+    proc_snapshot_free(&snap);
+    return result;
+}
+
+struct stopper_args {
+    struct event_source *src;
+    int finished;
+};
+
+/**
+ * Stop the message loop once everything the player sent has been applied
+ * (or lost to a full ring), unless every tree finished first.
+ */
+static void *stopper_main(void *arg) {
+    struct stopper_args *args = arg;
+    while (!__atomic_load_n(&args->finished, __ATOMIC_ACQUIRE)) {
+        unsigned long long handled = __atomic_load_n(&g_loop_stats.applied, __ATOMIC_RELAXED)
+            + __atomic_load_n(&g_loop_stats.ring_drops, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&args->src->drained, __ATOMIC_ACQUIRE)
+                && (handled >= __atomic_load_n(&args->src->injected, __ATOMIC_ACQUIRE))) {
+            kill(getpid(), SIGTERM);
+            break;
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+/**
+ * Play the trace through message_loop at `rate` events per second.
+ */
+static int replay_loop(const char *path, unsigned int rate) {
+    struct event_source src;
+    struct stopper_args args = {&src, 0};
+    struct timespec start, end;
+    pthread_t stopper;
+    sigset_t mask;
+    int result;
+
+    // The loop takes SIGTERM from its signalfd; no other thread may take it.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((result = source_trace(&src, path, rate)) < 0) {
+        fprintf(stderr, "Unable to play trace %s: %s\n", path, strerror(-result));
+        return result;
+    }
+    if ((result = pthread_create(&stopper, NULL, stopper_main, &args))) {
+        source_close(&src);
+        return -result;
+    }
+    result = message_loop(&src, -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_store_n(&args.finished, 1, __ATOMIC_RELEASE);
+    pthread_join(stopper, NULL);
+    unsigned long long events = __atomic_load_n(&src.injected, __ATOMIC_ACQUIRE);
+    source_close(&src);
+    if (result < 0) {
+        fprintf(stderr, "Message loop failed: %s\n", strerror(-result));
+        return result;
+    }
+    double ms = ms_between(&start, &end);
+    printf("loop:          %llu events sent, %llu applied, %llu lost to a full ring\n", events,
+        g_loop_stats.applied, g_loop_stats.ring_drops);
+    printf("rate:          %8.3f ms   %.0f events/s   %llu datagrams in %llu batches (largest %llu)\n", ms,
+        ms ? events * 1e3 / ms : 0, g_loop_stats.datagrams, g_loop_stats.batches, g_loop_stats.max_batch);
+    char line[512];
+    latency_format(line, sizeof line);
+    printf("latency:       p50/p90/p99/p99.9/max in us%s\n", line);
+    return 0;
+}
+
+static void print_tree(pid_t pid, pid_t trigger, unsigned int live, int teardown, void *ctx) {
+    printf("  tree %d (trigger %d): %u live%s\n", pid - FAKE_PID_BASE,
+        (trigger > 1) ? trigger - FAKE_PID_BASE : trigger, live, teardown ? ", being torn down" : "");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int rounds = 1, round, rate = 0;
+    int verbose = 0, through_loop = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:n:v")) != -1) {
+        switch (opt) {
+            case 'l': through_loop = 1; rate = atoi(optarg); break;
+            case 'n': rounds = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rounds | -l events per second] [-v] <trace file>\n", argv[0]);
+                return 1;
+        }
+    }
+    if ((argc - optind != 1) || !rounds) {
+        fprintf(stderr, "Usage: %s [-n rounds | -l events per second] [-v] <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    openlog("process-tracking-replay", LOG_PID | (verbose ? LOG_PERROR : 0), LOG_DAEMON);
+    setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_ERR));
+
+    struct trace_file trace;
+    int result;
+    memset(&trace, 0, sizeof trace);
+    if ((result = trace_map(argv[optind], &trace)) < 0) {
+        fprintf(stderr, "Unable to read trace %s: %s\n", argv[optind], strerror(-result));
+        return 1;
+    }
+    if (trace.count) {
+        printf("trace:         %llu records covering %.3f s\n", (unsigned long long)trace.count,
+            (trace.records[trace.count - 1].timestamp_ns - trace.records[0].timestamp_ns) / 1e9);
+    }
+
+    if (through_loop) {
+        if ((result = replay_loop(argv[optind], rate)) == 0) {
+            printf("final state:   %d trees still tracking, %zu KiB of tables\n", reap_trees(),
+                memory_footprint() / 1024);
+            visit_trees(print_tree, NULL);
+        }
+        finalize();
+        trace_unmap(&trace);
+        closelog();
+        return result ? 1 : 0;
+    }
+
+    struct replay_counts counts;
+    double best = 0;
+    for (round = 0; round < rounds; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = replay(&trace, &counts);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (result < 0) {
+            fprintf(stderr, "Replay failed: %s\n", strerror(-result));
+            break;
+        }
+        double ms = ms_between(&start, &end);
+        if (!round || (ms < best)) {
+            best = ms;
+        }
+        // The last round's trees are reported below.
+        if (round + 1 < rounds) {
+            finalize();
+        }
+    }
+    if (result == 0) {
+        unsigned long long events = counts.forks + counts.exits;
+        printf("replay:        %llu forks, %llu exits, %llu registrations, %llu usage ticks, %llu resyncs",
+            counts.forks, counts.exits, counts.registrations, counts.ticks, counts.resyncs);
+        if (counts.unknown) {
+            printf(", %llu unknown records skipped", counts.unknown);
+        }
+        printf("\n");
+        printf("rate:          %8.3f ms   %.0f events/s   %.0f records/s\n", best,
+            best ? events * 1e3 / best : 0, best ? trace.count * 1e3 / best : 0);
+        printf("final state:   %d trees still tracking, %zu KiB of tables\n", reap_trees(),
+            memory_footprint() / 1024);
+        visit_trees(print_tree, NULL);
+    }
+
+    finalize();
+    trace_unmap(&trace);
+    closelog();
+    return result ? 1 : 0;
+}
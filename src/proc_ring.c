@@ -0,0 +1,106 @@
+
+#include "config.h"
+
+#include <sys/eventfd.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_ring.h"
+
+int event_ring_init(struct event_ring *ring, unsigned int size) {
+    memset(ring, 0, sizeof *ring);
+    if (!size || (size & (size - 1))) {
+        return -EINVAL;
+    }
+    ring->slots = malloc(size * sizeof *ring->slots);
+    if (!ring->slots) {
+        syslog(LOG_ERR, "Unable to allocate event ring of %u entries.\n", size);
+        return -ENOMEM;
+    }
+    ring->mask = size - 1;
+    ring->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->efd == -1) {
+        syslog(LOG_ERR, "Unable to create eventfd: %d %s\n", errno, strerror(errno));
+        free(ring->slots);
+        ring->slots = NULL;
+        return -errno;
+    }
+    return 0;
+}
+
+void event_ring_destroy(struct event_ring *ring) {
+    if (ring->efd >= 0) {
+        close(ring->efd);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->efd = -1;
+}
+
+int event_ring_push(struct event_ring *ring, const struct proc_event *ev) {
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int used = ring->pending - tail;
+    if (used > ring->mask) {
+        __atomic_fetch_add(&ring->drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    ring->slots[ring->pending & ring->mask] = *ev;
+    ring->pending++;
+    // Counters are only written here; others read them with atomic loads.
+    if (used + 1 > ring->high_water) {
+        __atomic_store_n(&ring->high_water, used + 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void event_ring_publish(struct event_ring *ring) {
+    if (ring->pending == ring->head) {
+        return;
+    }
+    __atomic_store_n(&ring->head, ring->pending, __ATOMIC_RELEASE);
+    // Pairs with the fence in event_ring_prepare_sleep: either the consumer
+    // sees the new head, or we see that it is sleeping.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if ((write(ring->efd, &one, sizeof one) == -1) && (errno != EAGAIN)) {
+            syslog(LOG_ERR, "Unable to wake event processor: %d %s\n", errno, strerror(errno));
+        }
+    }
+}
+
+unsigned int event_ring_pop(struct event_ring *ring, struct proc_event *evs, unsigned int max) {
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int count = head - ring->tail;
+    if (count > max) {
+        count = max;
+    }
+    unsigned int idx;
+    for (idx = 0; idx < count; idx++) {
+        evs[idx] = ring->slots[(ring->tail + idx) & ring->mask];
+    }
+    __atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+int event_ring_prepare_sleep(struct event_ring *ring) {
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void event_ring_wake(struct event_ring *ring) {
+    uint64_t value;
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    // Nonblocking; nothing to read just means we woke for another reason.
+    if (read(ring->efd, &value, sizeof value) == -1) {}
+}
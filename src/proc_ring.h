@@ -0,0 +1,46 @@
+
+// A bounded single-producer/single-consumer ring of proc_events, used to
+// hand kernel events from the netlink reader thread to the thread that owns
+// the process trees.
+
+#ifndef __PROC_RING_H
+#define __PROC_RING_H
+
+#include <linux/cn_proc.h>
+
+// Must be a power of two.
+#define EVENT_RING_SIZE 65536
+
+struct event_ring {
+    struct proc_event *slots;
+    unsigned int mask;
+    int efd;                // eventfd the consumer sleeps on
+
+    // Producer side.
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int pending;   // written but not yet published
+    unsigned long long high_water;
+    unsigned long long drops;
+
+    // Consumer side.
+    unsigned int tail __attribute__((aligned(64)));
+    int sleeping;
+};
+
+int event_ring_init(struct event_ring *, unsigned int);
+void event_ring_destroy(struct event_ring *);
+
+// Producer: queue an event; returns -1 (and counts a drop) if full.
+int event_ring_push(struct event_ring *, const struct proc_event *);
+// Producer: make queued events visible and wake the consumer if needed.
+void event_ring_publish(struct event_ring *);
+
+// Consumer: take up to max events; returns the number taken.
+unsigned int event_ring_pop(struct event_ring *, struct proc_event *, unsigned int);
+// Consumer: announce we are about to sleep on efd.  Returns 0 if events
+// arrived in the meantime, in which case we must not sleep.
+int event_ring_prepare_sleep(struct event_ring *);
+// Consumer: done sleeping; clears the eventfd.
+void event_ring_wake(struct event_ring *);
+
+#endif
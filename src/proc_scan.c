@@ -0,0 +1,256 @@
+
+#include "config.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_keeper.h"
+#include "proc_log.h"
+#include "proc_scan.h"
+#include "proc_trace.h"
+
+// Not every libc we build against declares getdents64, so use the raw
+// syscall and its record layout.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// From the kernel's include/linux/sched.h; field 9 of /proc/<pid>/stat.
+#define PF_EXITING 0x00000004
+
+int proc_snapshot_add(struct proc_snapshot *snap, pid_t pid, pid_t ppid) {
+    if (snap->count == snap->size) {
+        unsigned int size = snap->size ? 2*snap->size : 4096;
+        pid_t *new_pid = realloc(snap->pid, size * sizeof *new_pid);
+        if (!new_pid) {
+            return -ENOMEM;
+        }
+        snap->pid = new_pid;
+        pid_t *new_ppid = realloc(snap->ppid, size * sizeof *new_ppid);
+        if (!new_ppid) {
+            return -ENOMEM;
+        }
+        snap->ppid = new_ppid;
+        snap->size = size;
+    }
+    snap->pid[snap->count] = pid;
+    snap->ppid[snap->count] = ppid;
+    snap->count++;
+    return 0;
+}
+
+void proc_snapshot_free(struct proc_snapshot *snap) {
+    free(snap->pid);
+    free(snap->ppid);
+    memset(snap, 0, sizeof *snap);
+}
+
+/**
+ * Read the parent of one process from /proc/<pid>/stat.  The command name
+ * may contain anything, including ") ", so we parse from the last ')'.
+ * Returns 0 for processes that are exiting, have exited or are zombies:
+ * their exit event may already have been sent, so they no longer belong to
+ * a tree.
+ */
+static pid_t read_ppid(int proc_fd, const char *name) {
+    char path[32], buf[512];
+    size_t len = strlen(name);
+    if (len + sizeof "/stat" > sizeof path) {
+        return 0;
+    }
+    memcpy(path, name, len);
+    memcpy(path + len, "/stat", sizeof "/stat");
+
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t count = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (count <= 0) {
+        return 0;
+    }
+    buf[count] = '\0';
+
+    char *ptr = strrchr(buf, ')');
+    if (!ptr || (ptr[1] != ' ') || !ptr[2] || (ptr[3] != ' ')) {
+        return 0;
+    }
+    char state = ptr[2];
+    if ((state == 'Z') || (state == 'X') || (state == 'x')) {
+        return 0;
+    }
+    pid_t ppid = 0;
+    for (ptr += 4; (*ptr >= '0') && (*ptr <= '9'); ptr++) {
+        ppid = ppid * 10 + (*ptr - '0');
+    }
+    // The exit event is sent from do_exit, well before the process turns
+    // into a zombie; skip pgrp, session, tty_nr and tpgid to check flags
+    // for PF_EXITING too.
+    int field;
+    for (field = 0; field < 4; field++) {
+        if (!(ptr = strchr(ptr + 1, ' '))) {
+            return 0;
+        }
+    }
+    if (strtoul(ptr + 1, NULL, 10) & PF_EXITING) {
+        return 0;
+    }
+    return ppid;
+}
+
+/**
+ * Record the pid and parent of every live process.  We use getdents64 and
+ * openat directly: readdir, fopen and fscanf cost several times more per pid
+ * and this runs exactly when the node is busiest.
+ */
+int proc_snapshot_take(struct proc_snapshot *snap) {
+    char buf[32*1024];
+    int result = 0;
+    snap->count = 0;
+
+    int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd == -1) {
+        log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to open /proc: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+
+    while (1) {
+        long count = syscall(SYS_getdents64, proc_fd, buf, sizeof buf);
+        if (count == -1) {
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to list /proc: %d %s\n", errno, strerror(errno));
+            result = -errno;
+            goto cleanup;
+        }
+        if (count == 0) {
+            break;
+        }
+        long offset;
+        for (offset = 0; offset < count; ) {
+            struct linux_dirent64 *dent = (struct linux_dirent64 *)(buf + offset);
+            offset += dent->d_reclen;
+
+            const char *ptr = dent->d_name;
+            pid_t pid = 0;
+            for (; (*ptr >= '0') && (*ptr <= '9'); ptr++) {
+                pid = pid * 10 + (*ptr - '0');
+            }
+            if (*ptr || !pid) {
+                continue;
+            }
+            pid_t ppid = read_ppid(proc_fd, dent->d_name);
+            if (!ppid && (pid != 1)) {
+                continue;
+            }
+            if ((result = proc_snapshot_add(snap, pid, ppid)) < 0) {
+                log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to allocate /proc snapshot of %u pids.\n", snap->count);
+                goto cleanup;
+            }
+        }
+    }
+
+cleanup:
+    close(proc_fd);
+    return result;
+}
+
+static int reconcile(enum log_category cat, int priority, const char *what) {
+    struct proc_snapshot snap;
+    struct timespec start, end;
+    int result;
+
+    memset(&snap, 0, sizeof snap);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((result = proc_snapshot_take(&snap)) < 0) {
+        goto cleanup;
+    }
+    trace_snapshot(&snap);
+    result = processResync(&snap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_async(cat, priority, "%s: %u pids in %ld us, %d changes.\n", what,
+        snap.count,
+        (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000,
+        result);
+
+cleanup:
+    proc_snapshot_free(&snap);
+    return result;
+}
+
+int proc_resync() {
+    return reconcile(LOG_CAT_OVERFLOW, LOG_NOTICE, "Resynchronised with /proc");
+}
+
+/**
+ * Called right after subscribing (or registering a tree): anything the
+ * payload forked before events started flowing is adopted from /proc, and
+ * events that race with the scan are merged safely by processResync.
+ */
+int proc_seed() {
+    return reconcile(LOG_CAT_TREE, LOG_INFO, "Seeded trees from /proc");
+}
+
+int stat_open(pid_t pid) {
+    char path[32];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    return (fd == -1) ? -errno : fd;
+}
+
+/**
+ * Parse utime and stime (fields 14 and 15) by hand, from the last ')' on
+ * like read_ppid.  The fd stays bound to the process it was opened for:
+ * once that process is reaped, reads fail with ESRCH, even if the pid has
+ * been reused.
+ */
+int stat_read_cpu(int fd, unsigned long *utime, unsigned long *stime) {
+    char buf[512];
+    ssize_t count = pread(fd, buf, sizeof buf - 1, 0);
+    if (count == -1) {
+        return -errno;
+    } else if (count == 0) {
+        return -ESRCH;
+    }
+    buf[count] = '\0';
+
+    const char *ptr = strrchr(buf, ')');
+    if (!ptr) {
+        return -EPROTO;
+    }
+    // utime is the twelfth field after the command name.
+    int spaces = 0;
+    for (ptr++; *ptr && (spaces < 12); ptr++) {
+        if (*ptr == ' ') {
+            spaces++;
+        }
+    }
+    unsigned long value[2] = {0, 0};
+    int idx;
+    for (idx = 0; idx < 2; idx++) {
+        if ((*ptr < '0') || (*ptr > '9')) {
+            return -EPROTO;
+        }
+        for (; (*ptr >= '0') && (*ptr <= '9'); ptr++) {
+            value[idx] = value[idx] * 10 + (*ptr - '0');
+        }
+        if (*ptr == ' ') {
+            ptr++;
+        }
+    }
+    *utime = value[0];
+    *stime = value[1];
+    return 0;
+}
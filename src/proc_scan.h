@@ -0,0 +1,41 @@
+
+// A fast snapshot of the process table, used to resynchronise the trees
+// after the kernel has dropped events.
+
+#ifndef __PROC_SCAN_H
+#define __PROC_SCAN_H
+
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct proc_snapshot {
+    pid_t *pid;
+    pid_t *ppid;
+    unsigned int count;
+    unsigned int size;
+};
+
+int proc_snapshot_take(struct proc_snapshot *);
+int proc_snapshot_add(struct proc_snapshot *, pid_t, pid_t);
+void proc_snapshot_free(struct proc_snapshot *);
+
+// Scan /proc and reconcile every tree with it.  Returns the number of
+// pids adopted or retired, or -errno.
+int proc_resync();
+// The same, for picking up processes forked before we subscribed.
+int proc_seed();
+
+// Sample the CPU time of one process, in ticks, from a /proc/<pid>/stat fd
+// that is kept open and re-read for every sample.  Both return -errno on
+// failure; stat_read_cpu returns -ESRCH once the process has been reaped.
+int stat_open(pid_t);
+int stat_read_cpu(int, unsigned long *, unsigned long *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+
+#include "config.h"
+
+#include <time.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_source.h"
+#include "proc_keeper.h"
+#include "proc_trace.h"
+#include "proc_util.h"
+
+// Enough room for any proc connector message.
+#define WIRE_SIZE (NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(struct proc_event)))
+
+void source_netlink(struct event_source *src, int sock) {
+    memset(src, 0, sizeof *src);
+    src->fd = sock;
+    src->kernel = 1;
+    src->inject_fd = -1;
+}
+
+int source_injector(struct event_source *src) {
+    int pair[2];
+    memset(src, 0, sizeof *src);
+    src->fd = src->inject_fd = -1;
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        syslog(LOG_ERR, "Unable to create injector socketpair: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    src->fd = pair[0];
+    src->inject_fd = pair[1];
+    return 0;
+}
+
+/**
+ * Send one event wrapped the way the proc connector wraps it.
+ */
+static int inject(struct event_source *src, struct proc_event *ev) {
+    char buf[WIRE_SIZE];
+    memset(buf, 0, sizeof buf);
+    struct nlmsghdr *nlmsghdr = (struct nlmsghdr *)buf;
+    nlmsghdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof *ev);
+    nlmsghdr->nlmsg_type = NLMSG_DONE;
+    struct cn_msg *cn_msg = NLMSG_DATA(nlmsghdr);
+    cn_msg->id.idx = CN_IDX_PROC;
+    cn_msg->id.val = CN_VAL_PROC;
+    cn_msg->len = sizeof *ev;
+    ev->timestamp_ns = now_ns();
+    memcpy(cn_msg->data, ev, sizeof *ev);
+    ssize_t len;
+    while (((len = send(src->inject_fd, buf, nlmsghdr->nlmsg_len, MSG_NOSIGNAL)) == -1) && (errno == EINTR)) {}
+    return (len == -1) ? -errno : 0;
+}
+
+int inject_fork(struct event_source *src, pid_t parent, pid_t child) {
+    struct proc_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.what = PROC_EVENT_FORK;
+    ev.event_data.fork.parent_pid = ev.event_data.fork.parent_tgid = parent;
+    ev.event_data.fork.child_pid = ev.event_data.fork.child_tgid = child;
+    return inject(src, &ev);
+}
+
+int inject_exit(struct event_source *src, pid_t pid) {
+    struct proc_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.what = PROC_EVENT_EXIT;
+    ev.event_data.exit.process_pid = ev.event_data.exit.process_tgid = pid;
+    return inject(src, &ev);
+}
+
+static void *player_main(void *arg) {
+    struct event_source *src = arg;
+    struct trace_file *trace = src->trace;
+    struct timespec next;
+    uint64_t idx;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (idx = 0; idx < trace->count; idx++) {
+        const struct trace_record *rec = &trace->records[idx];
+        int result;
+        if (rec->what == PROC_EVENT_FORK) {
+            result = inject_fork(src, fake_pid(rec->ppid), fake_pid(rec->pid));
+        } else if (rec->what == PROC_EVENT_EXIT) {
+            result = inject_exit(src, fake_pid(rec->pid));
+        } else {
+            continue;
+        }
+        if (result < 0) {
+            syslog(LOG_ERR, "Unable to inject trace event: %d %s\n", -result, strerror(-result));
+            break;
+        }
+        __atomic_add_fetch(&src->injected, 1, __ATOMIC_RELEASE);
+        if (src->rate) {
+            next.tv_nsec += 1000000000 / src->rate;
+            if (next.tv_nsec >= 1000000000) {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+        }
+    }
+    __atomic_store_n(&src->drained, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int source_trace(struct event_source *src, const char *path, unsigned int rate) {
+    int result;
+    if ((result = source_injector(src)) < 0) {
+        return result;
+    }
+    struct trace_file *trace = calloc(1, sizeof *trace);
+    if (!trace) {
+        source_close(src);
+        return -ENOMEM;
+    }
+    src->trace = trace;
+    src->rate = rate;
+    if ((result = trace_map(path, trace)) < 0) {
+        syslog(LOG_ERR, "Unable to read trace %s: %d %s\n", path, -result, strerror(-result));
+        source_close(src);
+        return result;
+    }
+    uint64_t idx;
+    for (idx = 0; idx < trace->count; idx++) {
+        if (trace->records[idx].what == TRACE_REGISTER) {
+            register_tree(fake_pid(trace->records[idx].pid), fake_pid(trace->records[idx].ppid), -1, NULL, NULL);
+        }
+    }
+    if ((result = pthread_create(&src->player, NULL, player_main, src))) {
+        syslog(LOG_ERR, "Unable to start trace player: %d %s\n", result, strerror(result));
+        source_close(src);
+        return -result;
+    }
+    src->playing = 1;
+    return 0;
+}
+
+void source_close(struct event_source *src) {
+    if (src->playing) {
+        // The player may be blocked on a full socket; shutting it down
+        // fails the send.
+        shutdown(src->inject_fd, SHUT_RDWR);
+        pthread_join(src->player, NULL);
+        src->playing = 0;
+    }
+    if (src->trace) {
+        trace_unmap(src->trace);
+        free(src->trace);
+        src->trace = NULL;
+    }
+    if (src->inject_fd >= 0) {
+        close(src->inject_fd);
+        close(src->fd);
+    }
+    src->fd = src->inject_fd = -1;
+}
@@ -0,0 +1,54 @@
+
+// Where message_loop gets its events: a socket carrying proc connector
+// datagrams, byte for byte as the kernel sends them.  Besides the kernel's
+// own socket, an injector writes wire images of fork and exit events into a
+// socketpair, and a recorded trace can be played into one at a set rate, so
+// the whole loop can be driven at controlled rates without root or a live
+// kernel stream.
+
+#ifndef __PROC_SOURCE_H
+#define __PROC_SOURCE_H
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct event_source {
+    int fd;              // read by message_loop
+    int kernel;          // a netlink socket: only datagrams from the kernel count
+    int inject_fd;       // the injector's end, or -1
+    // Trace playback.
+    pthread_t player;
+    int playing;
+    void *trace;
+    unsigned int rate;
+    unsigned long long injected;   // events sent so far; read atomically
+    int drained;                   // the whole trace has been sent
+};
+
+// The subscribed proc connector socket.  source_close leaves it open.
+void source_netlink(struct event_source *, int sock);
+
+// A socketpair fed by inject_fork and inject_exit, from any one thread.
+// Each blocks while the loop is a full socket buffer behind.
+int source_injector(struct event_source *);
+int inject_fork(struct event_source *, pid_t parent, pid_t child);
+int inject_exit(struct event_source *, pid_t);
+
+// Play the fork and exit events of a trace into an injector, at `rate`
+// events per second (0 for as fast as the loop takes them).  The trees the
+// trace registers are registered up front.  Pids are moved above
+// PID_MAX_LIMIT, as in process-tracking-replay, so no real process can be
+// signalled.
+int source_trace(struct event_source *, const char *path, unsigned int rate);
+
+void source_close(struct event_source *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#include "config.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_stats.h"
+#include "proc_police.h"
+#include "proc_keeper.h"
+#include "proc_latency.h"
+
+// Only the thread that owns the trees publishes.
+static struct stats_page *g_stats = NULL;
+static char g_stats_path[PATH_MAX];
+static uint64_t g_published_ns = 0;
+static uint64_t g_samples = 0, g_sample_last_ns = 0, g_sample_max_ns = 0;
+
+int stats_open(const char *dir, enum stats_role role, pid_t watched) {
+    int result;
+    if ((mkdir(dir, 0755) == -1) && (errno != EEXIST)) {
+        syslog(LOG_WARNING, "Unable to create stats directory %s: %d %s\n", dir, errno, strerror(errno));
+        return -errno;
+    }
+    snprintf(g_stats_path, sizeof g_stats_path, "%s/%d", dir, getpid());
+    int fd = open(g_stats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "Unable to create stats file %s: %d %s\n", g_stats_path, errno, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, sizeof *g_stats) == -1) {
+        syslog(LOG_WARNING, "Unable to size stats file %s: %d %s\n", g_stats_path, errno, strerror(errno));
+        goto fail;
+    }
+    void *map = mmap(NULL, sizeof *g_stats, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_WARNING, "Unable to map stats file %s: %d %s\n", g_stats_path, errno, strerror(errno));
+        goto fail;
+    }
+    close(fd);
+    g_stats = map;
+    g_stats->version = STATS_VERSION;
+    g_stats->size = sizeof *g_stats;
+    g_stats->role = role;
+    g_stats->pid = getpid();
+    g_stats->watched = watched;
+    g_stats->started_ns = g_stats->updated_ns = now_ns();
+    // Readers skip the page until the magic is there.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(g_stats->magic, STATS_MAGIC, sizeof g_stats->magic);
+    return 0;
+
+fail:
+    result = -errno;
+    close(fd);
+    unlink(g_stats_path);
+    return result;
+}
+
+void stats_close() {
+    if (!g_stats) {
+        return;
+    }
+    munmap(g_stats, sizeof *g_stats);
+    unlink(g_stats_path);
+    g_stats = NULL;
+}
+
+void stats_sampled(uint64_t ns) {
+    g_samples++;
+    g_sample_last_ns = ns;
+    if (ns > g_sample_max_ns) {
+        g_sample_max_ns = ns;
+    }
+}
+
+int stats_publish(int full) {
+    if (!g_stats) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    uint64_t due = g_published_ns + STATS_INTERVAL_MS * 1000000ULL;
+    if (!full && (now < due)) {
+        return (due - now + 999999) / 1000000;
+    }
+    g_published_ns = now;
+
+    struct tracker_stats trees;
+    get_tracker_stats(&trees, full);
+
+    struct stats_page *page = g_stats;
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->updated_ns = now;
+    page->events_received = __atomic_load_n(&g_loop_stats.events, __ATOMIC_RELAXED);
+    page->events_applied = __atomic_load_n(&g_loop_stats.applied, __ATOMIC_RELAXED);
+    page->forks_ignored = trees.ignored_forks;
+    page->exits_ignored = trees.ignored_exits;
+    page->overflows = __atomic_load_n(&g_loop_stats.overflows, __ATOMIC_RELAXED);
+    page->sock_drops = __atomic_load_n(&g_loop_stats.sock_drops, __ATOMIC_RELAXED);
+    page->ring_drops = __atomic_load_n(&g_loop_stats.ring_drops, __ATOMIC_RELAXED);
+    page->resyncs = __atomic_load_n(&g_loop_stats.resyncs, __ATOMIC_RELAXED);
+    page->rcvbuf = __atomic_load_n(&g_loop_stats.rcvbuf, __ATOMIC_RELAXED);
+    page->trees = trees.trees;
+    page->trees_stopping = trees.stopping;
+    page->trees_killing = trees.killing;
+    page->live_pids = trees.live_pids;
+    page->index_entries = trees.index_entries;
+    page->shared_entries = trees.shared_entries;
+    page->trigger_entries = trees.trigger_entries;
+    page->pending_exit_stats = trees.pending_exit_stats;
+    page->table_bytes = trees.table_bytes;
+    page->samples = g_samples;
+    page->sample_last_ns = g_sample_last_ns;
+    page->sample_max_ns = g_sample_max_ns;
+    page->usage_budget_ppm = trees.usage_budget_ppm;
+    page->usage_interval_ms = trees.usage_interval_ms;
+    page->usage_passes = trees.usage_passes;
+    page->usage_cpu_ns = trees.usage_cpu_ns;
+    page->usage_sampled = trees.usage_sampled;
+    page->usage_deferred = trees.usage_deferred;
+    page->usage_resting = trees.usage_resting;
+    if (full) {
+        page->cpu_user_usec = trees.utime_usec;
+        page->cpu_system_usec = trees.stime_usec;
+    }
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+    return -1;
+}
@@ -0,0 +1,118 @@
+// A page of live counters that every monitor and daemon keeps mapped in
+// STATS_DIR/<pid>, so collectors can read them without talking to the
+// process.  process-tracking-stats reads every page on the node.
+//
+// The writer brackets each update with `seq`: odd while it is writing,
+// even once done.  A reader copies the page and keeps the copy only if
+// `seq` was even and unchanged around it.  Fields are only ever added at
+// the end, with `size` telling how much of the page the writer knows.
+
+#ifndef __PROC_STATS_H
+#define __PROC_STATS_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATS_DIR "/run/lcmaps-process-tracking"
+#define STATS_MAGIC "PTSTATS"
+#define STATS_VERSION 1
+
+enum stats_role {
+    STATS_MONITOR = 1,
+    STATS_DAEMON,
+    STATS_POOL_MONITOR,
+};
+
+struct stats_page {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                  // bytes of this struct the writer fills
+    uint32_t seq;
+    uint32_t role;
+    int32_t pid;
+    int32_t watched;                // a monitor's watched pid, or 0
+    uint64_t started_ns;            // CLOCK_MONOTONIC
+    uint64_t updated_ns;
+
+    // Events, from the kernel to the trees.
+    uint64_t events_received;
+    uint64_t events_applied;
+    uint64_t forks_ignored;         // forked by a process nobody tracks
+    uint64_t exits_ignored;
+    uint64_t overflows;             // ENOBUFS
+    uint64_t sock_drops;            // datagrams the kernel dropped
+    uint64_t ring_drops;
+    uint64_t resyncs;
+    uint64_t rcvbuf;
+
+    // Trees.
+    uint64_t trees;
+    uint64_t trees_stopping;
+    uint64_t trees_killing;
+    uint64_t live_pids;
+
+    // Tables.
+    uint64_t index_entries;
+    uint64_t shared_entries;
+    uint64_t trigger_entries;
+    uint64_t pending_exit_stats;
+    uint64_t table_bytes;
+
+    // Usage sampling, and the CPU of every tree as of the last one.
+    uint64_t samples;
+    uint64_t sample_last_ns;
+    uint64_t sample_max_ns;
+    uint64_t cpu_user_usec;
+    uint64_t cpu_system_usec;
+
+    // How usage sampling kept to its CPU budget.
+    uint64_t usage_budget_ppm;      // of one CPU
+    uint64_t usage_interval_ms;
+    uint64_t usage_passes;
+    uint64_t usage_cpu_ns;
+    uint64_t usage_sampled;         // pids sampled, over all passes
+    uint64_t usage_deferred;        // due, but left for a later pass
+    uint64_t usage_resting;         // idle and not due in the last pass
+};
+
+// Create and map the page.  Without one, the calls below do nothing.
+int stats_open(const char *dir, enum stats_role, pid_t watched);
+// Unmap and remove the page.
+void stats_close();
+// How long the last usage pass took.
+void stats_sampled(uint64_t ns);
+// Copy the counters into the page.  Unless full, at most every
+// STATS_INTERVAL_MS, and without the CPU totals; returns the milliseconds
+// until an update skipped this way is due, or -1 if none is pending.
+#define STATS_INTERVAL_MS 100
+int stats_publish(int full);
+
+// A consistent copy of a page that may be being written; -EAGAIN if the
+// writer kept it busy.  Inline, so readers need nothing else linked in.
+static inline int stats_copy(const struct stats_page *page, struct stats_page *copy) {
+    int tries;
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(copy, page, sizeof *copy);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+    return -EAGAIN;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
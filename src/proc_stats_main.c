@@ -0,0 +1,215 @@
+
+/**
+ * Print the live counters of every monitor and daemon on the node, one
+ * line of key=value pairs each and a line of totals, for collectors.
+ * Pages are only mapped and copied; the processes are never woken.
+ *
+ * Pages left behind by processes that died without cleaning up are
+ * counted as stale, and removed with -c.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "proc_stats.h"
+#include "proc_util.h"
+
+static const char *role_name(uint32_t role) {
+    switch (role) {
+        case STATS_MONITOR: return "monitor";
+        case STATS_DAEMON: return "daemon";
+        case STATS_POOL_MONITOR: return "pool-monitor";
+        default: return "unknown";
+    }
+}
+
+/**
+ * Copy the page in `path`.  Returns 0, -ENOENT if the page is not ready or
+ * not ours, or -ESRCH if its writer is gone.
+ */
+static int read_page(const char *path, struct stats_page *page) {
+    struct stats_page *map;
+    struct stat st;
+    int result = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -errno;
+    }
+    if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)offsetof(struct stats_page, events_received))) {
+        close(fd);
+        return -ENOENT;
+    }
+    map = mmap(NULL, sizeof *map, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    if (memcmp(map->magic, STATS_MAGIC, sizeof map->magic) || (map->version != STATS_VERSION)) {
+        result = -ENOENT;
+        goto cleanup;
+    }
+    if ((result = stats_copy(map, page)) < 0) {
+        goto cleanup;
+    }
+    // Fields a smaller, older writer does not know about read as zero.
+    if (page->size < sizeof *page) {
+        memset((char *)page + page->size, 0, sizeof *page - page->size);
+    }
+    if ((kill(page->pid, 0) == -1) && (errno == ESRCH)) {
+        result = -ESRCH;
+    }
+
+cleanup:
+    munmap(map, sizeof *map);
+    return result;
+}
+
+// The counters shared by a page and the totals, as key=value pairs.
+static void print_counters(const struct stats_page *page) {
+    uint64_t due = page->usage_sampled + page->usage_deferred;
+    printf(" events_received=%llu events_applied=%llu forks_ignored=%llu exits_ignored=%llu"
+        " overflows=%llu sock_drops=%llu ring_drops=%llu resyncs=%llu rcvbuf=%llu"
+        " trees=%llu trees_stopping=%llu trees_killing=%llu live_pids=%llu"
+        " index_entries=%llu shared_entries=%llu trigger_entries=%llu pending_exit_stats=%llu table_bytes=%llu"
+        " samples=%llu sample_last_us=%.0f sample_max_us=%.0f cpu_user_s=%.2f cpu_system_s=%.2f"
+        " usage_passes=%llu usage_sampled=%llu usage_deferred=%llu usage_resting=%llu usage_coverage_pct=%.1f"
+        " usage_cpu_s=%.3f\n",
+        (unsigned long long)page->events_received, (unsigned long long)page->events_applied,
+        (unsigned long long)page->forks_ignored, (unsigned long long)page->exits_ignored,
+        (unsigned long long)page->overflows, (unsigned long long)page->sock_drops,
+        (unsigned long long)page->ring_drops, (unsigned long long)page->resyncs,
+        (unsigned long long)page->rcvbuf,
+        (unsigned long long)page->trees, (unsigned long long)page->trees_stopping,
+        (unsigned long long)page->trees_killing, (unsigned long long)page->live_pids,
+        (unsigned long long)page->index_entries, (unsigned long long)page->shared_entries,
+        (unsigned long long)page->trigger_entries, (unsigned long long)page->pending_exit_stats,
+        (unsigned long long)page->table_bytes,
+        (unsigned long long)page->samples, page->sample_last_ns / 1e3, page->sample_max_ns / 1e3,
+        page->cpu_user_usec / 1e6, page->cpu_system_usec / 1e6,
+        (unsigned long long)page->usage_passes, (unsigned long long)page->usage_sampled,
+        (unsigned long long)page->usage_deferred, (unsigned long long)page->usage_resting,
+        due ? 100.0 * page->usage_sampled / due : 100.0, page->usage_cpu_ns / 1e9);
+}
+
+// Sums over every page; the sampling times are maxima.
+static void add_page(struct stats_page *total, const struct stats_page *page) {
+    total->events_received += page->events_received;
+    total->events_applied += page->events_applied;
+    total->forks_ignored += page->forks_ignored;
+    total->exits_ignored += page->exits_ignored;
+    total->overflows += page->overflows;
+    total->sock_drops += page->sock_drops;
+    total->ring_drops += page->ring_drops;
+    total->resyncs += page->resyncs;
+    total->rcvbuf += page->rcvbuf;
+    total->trees += page->trees;
+    total->trees_stopping += page->trees_stopping;
+    total->trees_killing += page->trees_killing;
+    total->live_pids += page->live_pids;
+    total->index_entries += page->index_entries;
+    total->shared_entries += page->shared_entries;
+    total->trigger_entries += page->trigger_entries;
+    total->pending_exit_stats += page->pending_exit_stats;
+    total->table_bytes += page->table_bytes;
+    total->samples += page->samples;
+    if (page->sample_last_ns > total->sample_last_ns) {
+        total->sample_last_ns = page->sample_last_ns;
+    }
+    if (page->sample_max_ns > total->sample_max_ns) {
+        total->sample_max_ns = page->sample_max_ns;
+    }
+    total->cpu_user_usec += page->cpu_user_usec;
+    total->cpu_system_usec += page->cpu_system_usec;
+    total->usage_passes += page->usage_passes;
+    total->usage_cpu_ns += page->usage_cpu_ns;
+    total->usage_sampled += page->usage_sampled;
+    total->usage_deferred += page->usage_deferred;
+    total->usage_resting += page->usage_resting;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = STATS_DIR;
+    int totals_only = 0, clean = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ct")) != -1) {
+        switch (opt) {
+            case 'c': clean = 1; break;
+            case 't': totals_only = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-t] [-c] [<stats directory>]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "Usage: %s [-t] [-c] [<stats directory>]\n", argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        dir = argv[optind];
+    }
+
+    // Without the directory, no monitor has run here yet.
+    DIR *dp = opendir(dir);
+    if (!dp && (errno != ENOENT)) {
+        fprintf(stderr, "Unable to open %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    struct stats_page total;
+    unsigned int monitors = 0, daemons = 0, stale = 0;
+    struct dirent *entry;
+    uint64_t now = now_ns();
+    memset(&total, 0, sizeof total);
+    while (dp && (entry = readdir(dp))) {
+        char path[4096], *end;
+        struct stats_page page;
+        strtol(entry->d_name, &end, 10);
+        if ((entry->d_name[0] == '\0') || *end) {
+            continue;
+        }
+        snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+        int result = read_page(path, &page);
+        if (result == -ESRCH) {
+            stale++;
+            if (clean) {
+                unlink(path);
+            }
+            continue;
+        } else if (result < 0) {
+            continue;
+        }
+        if (page.role == STATS_DAEMON) {
+            daemons++;
+        } else {
+            monitors++;
+        }
+        add_page(&total, &page);
+        if (!totals_only) {
+            uint64_t uptime = now - page.started_ns;
+            printf("pid=%d role=%s watched=%d uptime_s=%.1f age_ms=%.0f usage_budget_pct=%g usage_used_pct=%.3g"
+                " usage_interval_ms=%llu", page.pid, role_name(page.role), page.watched, uptime / 1e9,
+                (now > page.updated_ns) ? (now - page.updated_ns) / 1e6 : 0, page.usage_budget_ppm / 1e4,
+                uptime ? 100.0 * page.usage_cpu_ns / uptime : 0, (unsigned long long)page.usage_interval_ms);
+            print_counters(&page);
+        }
+    }
+    if (dp) {
+        closedir(dp);
+    }
+
+    printf("processes=%u monitors=%u daemons=%u stale=%u", monitors + daemons, monitors, daemons, stale);
+    print_counters(&total);
+    return 0;
+}
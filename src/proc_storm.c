@@ -0,0 +1,322 @@
+
+/**
+ * A fork storm under a real monitor.  Run with `make bench-storm`, as root.
+ *
+ * The payload is a watched process with `idle` children that only sleep
+ * (a wide standing tree) and `workers` children that fork chains `depth`
+ * processes deep, which exit again straight away, at a paced rate.  The
+ * rate doubles every step until the kernel starts dropping events on the
+ * monitor's socket; each step reports the events per second the monitor
+ * was sent and its RSS.  Then the watched process is killed and we time
+ * how long the monitor takes to empty the tree.
+ *
+ * Drops are read from the monitor's entry in /proc/net/netlink, so with
+ * the eBPF backend there are none to report.
+ */
+
+#include "config.h"
+
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "proc_util.h"
+
+// Shared between us and every process of the payload.
+struct storm {
+    unsigned int rate;               // forks per second; 0 for flat out
+    unsigned long long forks;
+    unsigned int live;
+};
+
+static struct storm *g_storm = NULL;
+
+/**
+ * Fork a chain of `depth` processes; each waits for the next, the last
+ * exits at once.
+ */
+static void chain(unsigned int depth) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        __atomic_add_fetch(&g_storm->live, 1, __ATOMIC_RELAXED);
+        if (depth > 1) {
+            chain(depth - 1);
+        }
+        __atomic_sub_fetch(&g_storm->live, 1, __ATOMIC_RELAXED);
+        _exit(0);
+    } else if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/**
+ * One of `workers` processes sharing the storm's rate.  A worker that falls
+ * behind skips ahead rather than bursting to catch up.
+ */
+static void worker(unsigned int workers, unsigned int depth) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        chain(depth);
+        __atomic_add_fetch(&g_storm->forks, depth, __ATOMIC_RELAXED);
+        unsigned int rate = __atomic_load_n(&g_storm->rate, __ATOMIC_RELAXED);
+        if (!rate) {
+            continue;
+        }
+        long long interval = 1000000000LL * workers * depth / rate;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long behind = (now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec);
+        if (behind > interval) {
+            next = now;
+        }
+        next.tv_nsec += interval % 1000000000LL;
+        next.tv_sec += interval / 1000000000LL + next.tv_nsec / 1000000000LL;
+        next.tv_nsec %= 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+    }
+}
+
+static void payload(unsigned int idle, unsigned int workers, unsigned int depth) {
+    unsigned int idx;
+    setpgid(0, 0);
+    for (idx = 0; idx < idle; idx++) {
+        if (fork() == 0) {
+            __atomic_add_fetch(&g_storm->live, 1, __ATOMIC_RELAXED);
+            pause();
+            _exit(0);
+        }
+    }
+    for (idx = 0; idx < workers; idx++) {
+        if (fork() == 0) {
+            __atomic_add_fetch(&g_storm->live, 1, __ATOMIC_RELAXED);
+            worker(workers, depth);
+        }
+    }
+    pause();
+    _exit(0);
+}
+
+/**
+ * Datagrams the kernel dropped on the proc connector socket of `pid`, or
+ * -1 if it has none.
+ */
+static long long netlink_drops(pid_t pid) {
+    char line[512];
+    long long drops = -1;
+    int column = -1;
+    FILE *fp = fopen("/proc/net/netlink", "r");
+    if (!fp) {
+        return -1;
+    }
+    // Find the Drops column from the header; it has moved between kernels.
+    if (fgets(line, sizeof line, fp)) {
+        char *save = NULL, *tok;
+        int idx = 0;
+        for (tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save), idx++) {
+            if (!strcmp(tok, "Drops")) {
+                column = idx;
+            }
+        }
+    }
+    while ((column >= 0) && fgets(line, sizeof line, fp)) {
+        char *save = NULL, *tok;
+        long long fields[16];
+        int idx = 0;
+        for (tok = strtok_r(line, " \t\n", &save); tok && (idx < 16); tok = strtok_r(NULL, " \t\n", &save), idx++) {
+            fields[idx] = strtoll(tok, NULL, 10);
+        }
+        // Protocol 11 is NETLINK_CONNECTOR; the monitor binds to its pid.
+        if ((idx > column) && (fields[1] == 11) && (fields[2] == pid)) {
+            drops = fields[column];
+            break;
+        }
+    }
+    fclose(fp);
+    return drops;
+}
+
+// Current and peak RSS of pid, in KiB.
+static void read_rss(pid_t pid, unsigned long *rss, unsigned long *hwm) {
+    char path[32], line[256];
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    *rss = *hwm = 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "VmRSS: %lu", rss) == 1) {
+            continue;
+        }
+        sscanf(line, "VmHWM: %lu", hwm);
+    }
+    fclose(fp);
+}
+
+/**
+ * Start `monitor` on the watched process and wait until it is tracking.
+ */
+static pid_t start_monitor(const char *monitor, pid_t watched) {
+    int ready[2];
+    char byte;
+    if (pipe(ready) == -1) {
+        return -1;
+    }
+    pid_t mon = fork();
+    if (mon == 0) {
+        char pid_arg[16], ppid_arg[16];
+        dup2(ready[1], 1);
+        snprintf(pid_arg, sizeof pid_arg, "%d", watched);
+        snprintf(ppid_arg, sizeof ppid_arg, "%d", getppid());
+        execl(monitor, monitor, pid_arg, ppid_arg, (char *)NULL);
+        _exit(127);
+    }
+    close(ready[1]);
+    int started = (read(ready[0], &byte, 1) == 1);
+    close(ready[0]);
+    if (!started) {
+        fprintf(stderr, "%s did not start\n", monitor);
+        return -1;
+    }
+    return mon;
+}
+
+/**
+ * Double the rate every `seconds` from `rate` until the monitor's socket
+ * drops events or `max_rate` is passed.
+ */
+static void ramp(pid_t mon, unsigned int rate, unsigned int max_rate, unsigned int seconds) {
+    double sustained = 0;
+    long long drops = netlink_drops(mon);
+    for (; rate && (rate <= max_rate); rate *= 2) {
+        struct timespec start, end;
+        __atomic_store_n(&g_storm->rate, rate, __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        unsigned long long forks = __atomic_load_n(&g_storm->forks, __ATOMIC_RELAXED);
+        sleep(seconds);
+        forks = __atomic_load_n(&g_storm->forks, __ATOMIC_RELAXED) - forks;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long long now_drops = netlink_drops(mon);
+        unsigned long rss, hwm;
+        read_rss(mon, &rss, &hwm);
+        // A fork and an exit per process.
+        double events = 2e3 * forks / ms_between(&start, &end);
+        printf("storm:         %8u forks/s asked   %10.0f events/s   %8lld drops   RSS %6lu KiB (peak %lu)\n",
+            rate, events, (now_drops >= 0) ? now_drops - drops : -1, rss, hwm);
+        fflush(stdout);
+        if (now_drops > drops) {
+            break;
+        }
+        sustained = events;
+        // The generator cannot go any faster on this machine.
+        if (events < 2 * rate * 0.9) {
+            printf("storm:         generator saturated\n");
+            break;
+        }
+    }
+    printf("sustained:     %10.0f events/s without drops\n", sustained);
+}
+
+/**
+ * Kill the watched process and time until the monitor has killed the rest
+ * of the payload.  Orphans are reparented to us, so they are reaped here.
+ */
+static int converge(pid_t watched, pid_t mon) {
+    struct timespec start, now;
+    unsigned int live = __atomic_load_n(&g_storm->live, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kill(watched, SIGKILL);
+    while (1) {
+        while (waitpid(-1, NULL, WNOHANG) > 0) {}
+        if ((kill(-watched, 0) == -1) && (errno == ESRCH)) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ms_between(&start, &now) > 30000) {
+            fprintf(stderr, "payload was not killed within 30 s\n");
+            kill(-watched, SIGKILL);
+            return -ETIMEDOUT;
+        }
+        usleep(100);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("kill:          %8.3f ms to an empty tree   %u processes at the time\n",
+        ms_between(&start, &now), live);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int idle = 1000, workers = 4, depth = 1, rate = 1000, max_rate = 1000000, seconds = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:r:R:t:w:")) != -1) {
+        switch (opt) {
+            case 'd': depth = atoi(optarg); break;
+            case 'i': idle = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'R': max_rate = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-i idle processes] [-w workers] [-d chain depth] [-r first rate] [-R last rate]\n"
+                    "          [-t seconds per step] <monitor binary>\n", argv[0]);
+                return 1;
+        }
+    }
+    if ((argc - optind != 1) || !workers || !depth) {
+        fprintf(stderr, "Usage: %s [-i idle processes] [-w workers] [-d chain depth] [-r first rate] [-R last rate]\n"
+            "          [-t seconds per step] <monitor binary>\n", argv[0]);
+        return 1;
+    }
+
+    g_storm = mmap(NULL, sizeof *g_storm, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_storm == MAP_FAILED) {
+        return 1;
+    }
+    memset(g_storm, 0, sizeof *g_storm);
+    g_storm->rate = rate;
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    // Held until the monitor is tracking, so it sees every fork.
+    int go[2];
+    char byte;
+    if (pipe(go) == -1) {
+        return 1;
+    }
+    pid_t watched = fork();
+    if (watched == 0) {
+        close(go[1]);
+        if (read(go[0], &byte, 1) != 1) {
+            _exit(1);
+        }
+        payload(idle, workers, depth);
+    }
+    close(go[0]);
+    setpgid(watched, watched);
+    pid_t mon = start_monitor(argv[optind], watched);
+    int result = 0;
+    if (mon < 0) {
+        kill(watched, SIGKILL);
+        result = -ECHILD;
+    } else {
+        if (write(go[1], "x", 1) != 1) {}
+        while (__atomic_load_n(&g_storm->live, __ATOMIC_RELAXED) < idle + workers) {
+            usleep(1000);
+        }
+        ramp(mon, rate, max_rate, seconds);
+        result = converge(watched, mon);
+    }
+    close(go[1]);
+    while (waitpid(-1, NULL, 0) > 0) {}
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+    munmap(g_storm, sizeof *g_storm);
+    return result ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+
+// A dense table of per-pid records, indexed directly by pid.
+//
+// Pids are small integers below pid_max, so a flat array beats any hash
+// map.  To keep the footprint small on systems with a 4M pid_max, the array
+// is split into chunks that are only allocated once a pid in their range is
+// used; an occupancy bitmap per chunk says which records are live.
+//
+// A chunk is released as soon as its last record is erased, so memory is
+// bounded by the pids currently tracked rather than by every pid the table
+// has ever seen as the kernel cycles through the pid space.  One empty chunk
+// is kept as a spare, so a tree whose only process in a chunk keeps forking
+// and exiting does not hit the allocator each time.
+
+#ifndef __PROC_TABLE_H
+#define __PROC_TABLE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PID_CHUNK_BITS 10
+#define PID_CHUNK_SIZE (1 << PID_CHUNK_BITS)
+#define PID_CHUNK_MASK (PID_CHUNK_SIZE - 1)
+
+template <class T>
+class PidTable {
+
+public:
+    PidTable(pid_t max_pid = 0) :
+        m_chunks(NULL),
+        m_spare(NULL),
+        m_chunk_count(0),
+        m_size(0)
+    {
+        grow(max_pid > 0 ? max_pid : 1);
+    }
+
+    ~PidTable() {
+        clear();
+        free(m_spare);
+        free(m_chunks);
+    }
+
+    // Size the top level for pids up to max_pid.
+    bool reserve(pid_t max_pid) {
+        return grow(max_pid);
+    }
+
+    inline T *find(pid_t pid) const {
+        if (pid <= 0) return NULL;
+        unsigned int idx = (unsigned int)pid >> PID_CHUNK_BITS;
+        if (idx >= m_chunk_count) return NULL;
+        Chunk *chunk = m_chunks[idx];
+        unsigned int off = pid & PID_CHUNK_MASK;
+        if (!chunk || !(chunk->bits[off >> 6] & (1ULL << (off & 63)))) return NULL;
+        return &chunk->recs[off];
+    }
+
+    // Returns the zeroed record for pid, or the existing one if it is
+    // already present.  Returns NULL only if a chunk cannot be allocated.
+    T *insert(pid_t pid) {
+        if (pid <= 0) return NULL;
+        unsigned int idx = (unsigned int)pid >> PID_CHUNK_BITS;
+        if ((idx >= m_chunk_count) && !grow(pid)) return NULL;
+        Chunk *chunk = m_chunks[idx];
+        if (!chunk) {
+            if (m_spare) {
+                // Records are zeroed on insert; only the bitmap must be clear.
+                chunk = m_spare;
+                m_spare = NULL;
+            } else if (!(chunk = static_cast<Chunk *>(calloc(1, sizeof(Chunk))))) {
+                return NULL;
+            }
+            m_chunks[idx] = chunk;
+        }
+        unsigned int off = pid & PID_CHUNK_MASK;
+        uint64_t bit = 1ULL << (off & 63);
+        if (!(chunk->bits[off >> 6] & bit)) {
+            chunk->bits[off >> 6] |= bit;
+            chunk->count++;
+            m_size++;
+            memset(&chunk->recs[off], 0, sizeof(T));
+        }
+        return &chunk->recs[off];
+    }
+
+    void erase(pid_t pid) {
+        if (!find(pid)) return;
+        unsigned int idx = (unsigned int)pid >> PID_CHUNK_BITS;
+        Chunk *chunk = m_chunks[idx];
+        unsigned int off = pid & PID_CHUNK_MASK;
+        chunk->bits[off >> 6] &= ~(1ULL << (off & 63));
+        m_size--;
+        if (!--chunk->count) {
+            m_chunks[idx] = NULL;
+            if (m_spare) {
+                free(chunk);
+            } else {
+                m_spare = chunk;
+            }
+        }
+    }
+
+    // Iteration in pid order: for (pid = t.next(0); pid; pid = t.next(pid))
+    // Safe against erasing the current pid, but record pointers are only
+    // valid until the next erase.
+    pid_t next(pid_t after) const {
+        unsigned int pid = after + 1;
+        unsigned int idx = pid >> PID_CHUNK_BITS;
+        for (; idx < m_chunk_count; idx++, pid = idx << PID_CHUNK_BITS) {
+            Chunk *chunk = m_chunks[idx];
+            if (!chunk) continue;
+            unsigned int off = pid & PID_CHUNK_MASK;
+            unsigned int word = off >> 6;
+            uint64_t bits = chunk->bits[word] & (~0ULL << (off & 63));
+            while (1) {
+                if (bits) {
+                    return (idx << PID_CHUNK_BITS) | (word << 6) | __builtin_ctzll(bits);
+                }
+                if (++word == PID_CHUNK_SIZE / 64) break;
+                bits = chunk->bits[word];
+            }
+        }
+        return 0;
+    }
+
+    inline unsigned int size() const {return m_size;}
+
+    // Bytes held by the table, for reporting.
+    size_t footprint() const {
+        size_t bytes = m_chunk_count * sizeof(Chunk *);
+        if (m_spare) bytes += sizeof(Chunk);
+        unsigned int idx;
+        for (idx = 0; idx < m_chunk_count; idx++) {
+            if (m_chunks[idx]) bytes += sizeof(Chunk);
+        }
+        return bytes;
+    }
+
+    void clear() {
+        unsigned int idx;
+        for (idx = 0; idx < m_chunk_count; idx++) {
+            free(m_chunks[idx]);
+            m_chunks[idx] = NULL;
+        }
+        m_size = 0;
+    }
+
+private:
+    // Records are plain data: chunks are calloc'd and records memset.
+    struct Chunk {
+        uint64_t bits[PID_CHUNK_SIZE / 64];
+        unsigned int count;
+        T recs[PID_CHUNK_SIZE];
+    };
+
+    // pid_max can be raised at runtime, so the top level grows on demand.
+    bool grow(pid_t max_pid) {
+        unsigned int count = ((unsigned int)max_pid >> PID_CHUNK_BITS) + 1;
+        if (count <= m_chunk_count) return true;
+        Chunk **chunks = static_cast<Chunk **>(realloc(m_chunks, count * sizeof(Chunk *)));
+        if (!chunks) return false;
+        memset(chunks + m_chunk_count, 0, (count - m_chunk_count) * sizeof(Chunk *));
+        m_chunks = chunks;
+        m_chunk_count = count;
+        return true;
+    }
+
+    PidTable(const PidTable &);
+    PidTable &operator=(const PidTable &);
+
+    Chunk **m_chunks;
+    Chunk *m_spare;
+    unsigned int m_chunk_count;
+    unsigned int m_size;
+};
+
+#endif
@@ -0,0 +1,268 @@
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_keeper.h"
+#include "proc_taskstats.h"
+#include "proc_log.h"
+
+// Attributes are NLA_ALIGNed; the payload of one is at most a taskstats.
+#define GENL_DATA(nlh) ((char *)NLMSG_DATA(nlh) + GENL_HDRLEN)
+#define NLA_DATA(nla) ((char *)(nla) + NLA_HDRLEN)
+#define NLA_NEXT(nla) ((struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+#define NLA_OK(nla, end) (((char *)(nla) + NLA_HDRLEN <= (end)) && ((nla)->nla_len >= NLA_HDRLEN) \
+    && ((char *)(nla) + (nla)->nla_len <= (end)))
+
+// Notifications read per taskstats_drain call.  Exits all over the node
+// land on the socket; without a bound, a node that exits processes as fast
+// as we can read keeps us here for ever.
+#define TASKSTATS_DRAIN_MAX 1024
+
+static int g_taskstats_sock = -1;
+static int g_taskstats_family = 0;
+static char g_cpumask[64];
+
+/**
+ * Send one generic netlink command carrying a single attribute.
+ */
+static int genl_send(int sock, int family, int cmd, int attr, const void *data, size_t len) {
+    struct {
+        struct nlmsghdr n;
+        struct genlmsghdr g;
+        char buf[256];
+    } req;
+    if (NLA_HDRLEN + len > sizeof req.buf) {
+        return -EINVAL;
+    }
+    memset(&req, 0, sizeof req);
+    req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_HDRLEN + NLA_ALIGN(len);
+    req.n.nlmsg_type = family;
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_pid = getpid();
+    req.g.cmd = cmd;
+    req.g.version = 1;
+    struct nlattr *nla = (struct nlattr *)req.buf;
+    nla->nla_type = attr;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(NLA_DATA(nla), data, len);
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+    if (sendto(sock, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&addr, sizeof addr) == -1) {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Look up the id the kernel gave the TASKSTATS family.
+ */
+static int resolve_family(int sock) {
+    int result;
+    if ((result = genl_send(sock, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+            TASKSTATS_GENL_NAME, sizeof TASKSTATS_GENL_NAME)) < 0) {
+        return result;
+    }
+    char buf[4096];
+    ssize_t len = recv(sock, buf, sizeof buf, 0);
+    if (len == -1) {
+        return -errno;
+    }
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    if (!NLMSG_OK(nlh, len)) {
+        return -EPROTO;
+    }
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *err = NLMSG_DATA(nlh);
+        return err->error ? err->error : -EPROTO;
+    }
+    char *end = (char *)nlh + nlh->nlmsg_len;
+    struct nlattr *nla;
+    for (nla = (struct nlattr *)GENL_DATA(nlh); NLA_OK(nla, end); nla = NLA_NEXT(nla)) {
+        if (nla->nla_type == CTRL_ATTR_FAMILY_ID) {
+            return *(__u16 *)NLA_DATA(nla);
+        }
+    }
+    return -ENOENT;
+}
+
+int taskstats_open() {
+    int result;
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (sock == -1) {
+        syslog(LOG_ERR, "Unable to create a generic netlink socket: %d %s\n", errno, strerror(errno));
+        return -errno;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof addr) == -1) {
+        result = -errno;
+        syslog(LOG_ERR, "Unable to bind generic netlink socket: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    // Every exit on the node lands here; a lost notification only costs
+    // accounting, but make that unlikely.
+    int size = 1024*1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+    if ((result = resolve_family(sock)) < 0) {
+        syslog(LOG_ERR, "Unable to find the taskstats family: %d %s\n", -result, strerror(-result));
+        goto fail;
+    }
+    g_taskstats_family = result;
+
+    // Exits are only reported to listeners registered for the CPU they
+    // happen on, so ask for all of them.
+    FILE *fp = fopen("/sys/devices/system/cpu/possible", "r");
+    if (!fp || !fgets(g_cpumask, sizeof g_cpumask, fp)) {
+        snprintf(g_cpumask, sizeof g_cpumask, "0-%ld", sysconf(_SC_NPROCESSORS_CONF) - 1);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    g_cpumask[strcspn(g_cpumask, "\n")] = '\0';
+    if ((result = genl_send(sock, g_taskstats_family, TASKSTATS_CMD_GET,
+            TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, g_cpumask, strlen(g_cpumask) + 1)) < 0) {
+        syslog(LOG_ERR, "Unable to register for taskstats on CPUs %s: %d %s\n", g_cpumask, -result, strerror(-result));
+        goto fail;
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        result = -errno;
+        syslog(LOG_ERR, "Unable to make taskstats socket non-blocking: %d %s\n", errno, strerror(errno));
+        goto fail;
+    }
+    g_taskstats_sock = sock;
+    set_exact_exits(1);
+    return 0;
+
+fail:
+    close(sock);
+    return result;
+}
+
+/**
+ * Pull the pid and stats out of one TASKSTATS_TYPE_AGGR_* attribute, and
+ * the thread group of a thread's record, or 0 if the kernel (before
+ * taskstats version 12) does not report it.
+ */
+static pid_t parse_aggr(struct nlattr *aggr, struct exit_stats *stats, pid_t *tgid) {
+    char *end = (char *)aggr + aggr->nla_len;
+    pid_t pid = 0;
+    int found = 0;
+    struct nlattr *nla;
+    for (nla = (struct nlattr *)NLA_DATA(aggr); NLA_OK(nla, end); nla = NLA_NEXT(nla)) {
+        if ((nla->nla_type == TASKSTATS_TYPE_PID) || (nla->nla_type == TASKSTATS_TYPE_TGID)) {
+            pid = *(__u32 *)NLA_DATA(nla);
+        } else if (nla->nla_type == TASKSTATS_TYPE_STATS) {
+            // Older kernels send a shorter struct; fields are only appended.
+            struct taskstats ts;
+            memset(&ts, 0, sizeof ts);
+            size_t len = nla->nla_len - NLA_HDRLEN;
+            memcpy(&ts, NLA_DATA(nla), (len < sizeof ts) ? len : sizeof ts);
+            stats->utime_usec = ts.ac_utime;
+            stats->stime_usec = ts.ac_stime;
+            stats->rss_kb = ts.hiwater_rss;
+            stats->read_bytes = ts.read_bytes;
+            stats->write_bytes = ts.write_bytes;
+#if TASKSTATS_VERSION >= 12
+            *tgid = (ts.version >= 12) ? ts.ac_tgid : 0;
+#else
+            *tgid = 0;
+#endif
+            found = 1;
+        }
+    }
+    return found ? pid : 0;
+}
+
+int taskstats_drain() {
+    if (g_taskstats_sock < 0) {
+        return 0;
+    }
+    char buf[8192];
+    int count = 0, lost = 0, reads;
+    for (reads = 0; reads < TASKSTATS_DRAIN_MAX; reads++) {
+        ssize_t len = recv(g_taskstats_sock, buf, sizeof buf, 0);
+        if (len == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            } else if (errno == ENOBUFS) {
+                if (!lost++) {
+                    log_async(LOG_CAT_OVERFLOW, LOG_WARNING, "Lost taskstats exit notifications; CPU accounting will be short.\n");
+                }
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            log_async(LOG_CAT_ERROR, LOG_ERR, "Unable to read taskstats: %d %s\n", errno, strerror(errno));
+            return -errno;
+        }
+        struct nlmsghdr *nlh;
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != g_taskstats_family) {
+                continue;
+            }
+            char *end = (char *)nlh + nlh->nlmsg_len;
+            struct exit_stats pid_stats, tgid_stats;
+            pid_t pid = 0, tgid = 0, thread_tgid = 0, unused;
+            struct nlattr *nla;
+            for (nla = (struct nlattr *)GENL_DATA(nlh); NLA_OK(nla, end); nla = NLA_NEXT(nla)) {
+                if (nla->nla_type == TASKSTATS_TYPE_AGGR_PID) {
+                    pid = parse_aggr(nla, &pid_stats, &thread_tgid);
+                } else if (nla->nla_type == TASKSTATS_TYPE_AGGR_TGID) {
+                    tgid = parse_aggr(nla, &tgid_stats, &unused);
+                }
+            }
+            count++;
+            if (!pid) {
+                continue;
+            }
+            // Every thread reports its own CPU, RSS and IO; the thread
+            // group record sent with the last one only carries delay
+            // accounting.  Each thread's record is added to its process,
+            // so the process exit sees the sum.  Without the thread group
+            // in the record, the threads that went first cannot be
+            // attributed, and the process keeps its /proc samples.
+            if (tgid) {
+                if (thread_tgid) {
+                    processExitStats(tgid, &pid_stats);
+                }
+            } else {
+                processExitStats(thread_tgid ? thread_tgid : pid, &pid_stats);
+            }
+        }
+    }
+    return count;
+}
+
+int taskstats_fd() {
+    return g_taskstats_sock;
+}
+
+void taskstats_close() {
+    if (g_taskstats_sock < 0) {
+        return;
+    }
+    genl_send(g_taskstats_sock, g_taskstats_family, TASKSTATS_CMD_GET,
+        TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK, g_cpumask, strlen(g_cpumask) + 1);
+    close(g_taskstats_sock);
+    g_taskstats_sock = -1;
+    set_exact_exits(0);
+}
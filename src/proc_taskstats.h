@@ -0,0 +1,37 @@
+
+// Exit-time accounting from the kernel's taskstats interface: every process
+// exit on the node is reported, with its exact CPU time, RSS high-water mark
+// and IO, just before the proc connector reports the exit itself.
+
+#ifndef __PROC_TASKSTATS_H
+#define __PROC_TASKSTATS_H
+
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct exit_stats {
+    unsigned long long utime_usec;
+    unsigned long long stime_usec;
+    unsigned long long rss_kb;       // high-water mark
+    unsigned long long read_bytes;   // storage IO; 0 without task IO accounting
+    unsigned long long write_bytes;
+};
+
+// Subscribe to exit notifications for every CPU.  Returns 0 or a negative
+// errno; without a subscription taskstats_drain does nothing.
+int taskstats_open();
+// Hand queued exit notifications to processExitStats, up to a bound.  Must
+// run before the proc connector events read after it are dispatched.
+int taskstats_drain();
+// The socket to poll for notifications, or -1 if not subscribed.
+int taskstats_fd();
+void taskstats_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "proc_trace.h"
+#include "proc_scan.h"
+#include "proc_util.h"
+
+// The file starts at TRACE_INITIAL_BYTES and doubles as it fills; a daemon
+// on a busy node stops recording at TRACE_MAX_BYTES (some 45M records)
+// rather than fill the disk.
+#define TRACE_INITIAL_BYTES (4*1024*1024)
+#define TRACE_MAX_BYTES (1024*1024*1024)
+
+// Only the thread that owns the trees records.
+static struct trace_header *g_trace = NULL;
+static int g_trace_fd = -1;
+static size_t g_trace_len = 0;
+
+static size_t trace_used() {
+    return sizeof(struct trace_header) + g_trace->records * sizeof(struct trace_record);
+}
+
+int trace_open(const char *path) {
+    int result;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Unable to create trace file %s: %d %s\n", path, errno, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, TRACE_INITIAL_BYTES) == -1) {
+        syslog(LOG_ERR, "Unable to size trace file %s: %d %s\n", path, errno, strerror(errno));
+        goto fail;
+    }
+    void *map = mmap(NULL, TRACE_INITIAL_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to map trace file %s: %d %s\n", path, errno, strerror(errno));
+        goto fail;
+    }
+    g_trace = map;
+    g_trace_fd = fd;
+    g_trace_len = TRACE_INITIAL_BYTES;
+    memcpy(g_trace->magic, TRACE_MAGIC, sizeof g_trace->magic);
+    g_trace->version = TRACE_VERSION;
+    g_trace->record_size = sizeof(struct trace_record);
+    g_trace->records = 0;
+    syslog(LOG_INFO, "Recording events to %s.\n", path);
+    return 0;
+
+fail:
+    result = -errno;
+    close(fd);
+    return result;
+}
+
+void trace_close() {
+    if (!g_trace) {
+        return;
+    }
+    // Drop the unused tail.
+    if (ftruncate(g_trace_fd, trace_used()) == -1) {
+        syslog(LOG_ERR, "Unable to trim trace file: %d %s\n", errno, strerror(errno));
+    }
+    munmap(g_trace, g_trace_len);
+    close(g_trace_fd);
+    g_trace = NULL;
+    g_trace_fd = -1;
+    g_trace_len = 0;
+}
+
+static int trace_grow() {
+    size_t len = g_trace_len * 2;
+    if (len > TRACE_MAX_BYTES) {
+        syslog(LOG_WARNING, "Trace file is full after %llu records; no longer recording.\n",
+            (unsigned long long)g_trace->records);
+        trace_close();
+        return -EFBIG;
+    }
+    if (ftruncate(g_trace_fd, len) == -1) {
+        syslog(LOG_ERR, "Unable to grow trace file; no longer recording: %d %s\n", errno, strerror(errno));
+        trace_close();
+        return -errno;
+    }
+    void *map = mremap(g_trace, g_trace_len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Unable to remap trace file; no longer recording: %d %s\n", errno, strerror(errno));
+        trace_close();
+        return -errno;
+    }
+    g_trace = map;
+    g_trace_len = len;
+    return 0;
+}
+
+/**
+ * Append one record.  The header count is only bumped once it is filled
+ * in, so a crash never leaves a torn record behind.
+ */
+static void trace_append(uint32_t what, uint32_t cpu, uint64_t timestamp_ns, pid_t pid, pid_t ppid) {
+    if ((trace_used() + sizeof(struct trace_record) > g_trace_len) && (trace_grow() < 0)) {
+        return;
+    }
+    struct trace_record *rec = (struct trace_record *)(g_trace + 1) + g_trace->records;
+    rec->timestamp_ns = timestamp_ns;
+    rec->what = what;
+    rec->cpu = cpu;
+    rec->pid = pid;
+    rec->ppid = ppid;
+    __atomic_store_n(&g_trace->records, g_trace->records + 1, __ATOMIC_RELEASE);
+}
+
+void trace_event(uint32_t what, uint32_t cpu, uint64_t timestamp_ns, pid_t pid, pid_t ppid) {
+    if (g_trace) {
+        trace_append(what, cpu, timestamp_ns, pid, ppid);
+    }
+}
+
+void trace_register(pid_t watched, pid_t trigger) {
+    if (g_trace) {
+        trace_append(TRACE_REGISTER, 0, now_ns(), watched, trigger);
+    }
+}
+
+void trace_usage() {
+    if (g_trace) {
+        trace_append(TRACE_USAGE, 0, now_ns(), 0, 0);
+    }
+}
+
+void trace_snapshot(const struct proc_snapshot *snap) {
+    if (!g_trace) {
+        return;
+    }
+    uint64_t ts = now_ns();
+    unsigned int idx;
+    for (idx = 0; (idx < snap->count) && g_trace; idx++) {
+        trace_append(TRACE_SNAPSHOT, 0, ts, snap->pid[idx], snap->ppid[idx]);
+    }
+    if (g_trace) {
+        trace_append(TRACE_RESYNC, 0, ts, snap->count, 0);
+    }
+}
+
+int trace_map(const char *path, struct trace_file *trace) {
+    struct stat st;
+    int result = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -errno;
+    }
+    if (fstat(fd, &st) == -1) {
+        result = -errno;
+        goto cleanup;
+    }
+    if ((size_t)st.st_size < sizeof(struct trace_header)) {
+        result = -EPROTO;
+        goto cleanup;
+    }
+    trace->len = st.st_size;
+    trace->map = mmap(NULL, trace->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED) {
+        trace->map = NULL;
+        result = -errno;
+        goto cleanup;
+    }
+    const struct trace_header *header = trace->map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof header->magic)
+            || (header->version != TRACE_VERSION)
+            || (header->record_size != sizeof(struct trace_record))) {
+        trace_unmap(trace);
+        result = -EPROTO;
+        goto cleanup;
+    }
+    // A copy taken while the file was growing may be cut short.
+    uint64_t fits = (trace->len - sizeof *header) / sizeof(struct trace_record);
+    trace->count = (header->records < fits) ? header->records : fits;
+    trace->records = (const struct trace_record *)(header + 1);
+
+cleanup:
+    close(fd);
+    return result;
+}
+
+void trace_unmap(struct trace_file *trace) {
+    if (trace->map) {
+        munmap(trace->map, trace->len);
+    }
+    trace->map = NULL;
+    trace->records = NULL;
+    trace->count = 0;
+}
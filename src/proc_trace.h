@@ -0,0 +1,72 @@
+
+// A binary trace of everything the trees are fed: kernel fork and exit
+// events with their timestamps, registrations, usage ticks and the /proc
+// snapshots behind each seed or resync.  process-tracking-replay feeds a
+// trace back through the trees, so problems seen on a production node can
+// be reproduced, and the tree code timed, anywhere.
+//
+// The file is a trace_header followed by fixed-size records, in native
+// byte order, written through a shared mapping; a monitor that crashes
+// leaves every record it had appended.
+
+#ifndef __PROC_TRACE_H
+#define __PROC_TRACE_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC "PTTRACE"
+#define TRACE_VERSION 1
+
+// Fork and exit records keep the proc connector's own values for `what`;
+// the rest use bits it leaves alone.
+#define TRACE_REGISTER 0x01000000  // pid is watched, ppid the trigger pid
+#define TRACE_USAGE    0x02000000  // a usage tick
+#define TRACE_SNAPSHOT 0x04000000  // one process of a /proc snapshot
+#define TRACE_RESYNC   0x08000000  // the snapshot so far is complete
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t records;      // records written so far
+};
+
+struct trace_record {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC, as the kernel stamps events
+    uint32_t what;
+    uint32_t cpu;
+    int32_t pid;           // child on fork
+    int32_t ppid;          // parent on fork
+};
+
+// Start recording to path, truncating it.  Returns 0 or a negative errno.
+int trace_open(const char *path);
+void trace_close();
+
+// Each is a no-op unless a trace is open.
+void trace_event(uint32_t what, uint32_t cpu, uint64_t timestamp_ns, pid_t pid, pid_t ppid);
+void trace_register(pid_t, pid_t);
+void trace_usage();
+struct proc_snapshot;
+void trace_snapshot(const struct proc_snapshot *);
+
+// Map a trace for reading.  Returns 0 or a negative errno.
+struct trace_file {
+    const struct trace_record *records;
+    uint64_t count;
+    void *map;
+    size_t len;
+};
+int trace_map(const char *path, struct trace_file *);
+void trace_unmap(struct trace_file *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
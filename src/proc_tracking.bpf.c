@@ -0,0 +1,82 @@
+
+/**
+ * Kernel half of the eBPF event backend.
+ *
+ * Unlike the proc connector, which hands every fork and exit on the node to
+ * userspace, this only reports events for tgids in the tracked map.  Forks
+ * from a member add the child to the map here in the kernel, so a tree is
+ * followed without a round trip through userspace.
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "proc_ebpf_event.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 1 << 20);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, __u32);
+    __type(value, __u32);
+} tracked SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 1 << 22);
+} events SEC(".maps");
+
+// Events we could not deliver (ring buffer or tracked map full).
+__u64 dropped = 0;
+
+static __always_inline void emit(__u32 what, __u32 parent_tgid, __u32 tgid) {
+    struct tracking_event *ev = bpf_ringbuf_reserve(&events, sizeof *ev, 0);
+    if (!ev) {
+        __sync_fetch_and_add(&dropped, 1);
+        return;
+    }
+    ev->timestamp_ns = bpf_ktime_get_ns();
+    ev->what = what;
+    ev->parent_tgid = parent_tgid;
+    ev->tgid = tgid;
+    bpf_ringbuf_submit(ev, 0);
+}
+
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(handle_fork, struct task_struct *parent, struct task_struct *child) {
+    __u32 child_tgid = BPF_CORE_READ(child, tgid);
+    // New threads are not new processes.
+    if (BPF_CORE_READ(child, pid) != child_tgid) {
+        return 0;
+    }
+    __u32 parent_tgid = BPF_CORE_READ(parent, tgid);
+    __u32 *flags = bpf_map_lookup_elem(&tracked, &parent_tgid);
+    if (!flags || !(*flags & TRACK_MEMBER)) {
+        return 0;
+    }
+    __u32 member = TRACK_MEMBER;
+    if (bpf_map_update_elem(&tracked, &child_tgid, &member, BPF_ANY)) {
+        __sync_fetch_and_add(&dropped, 1);
+    }
+    emit(TRACKING_EVENT_FORK, parent_tgid, child_tgid);
+    return 0;
+}
+
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(handle_exit, struct task_struct *task) {
+    __u32 tgid = BPF_CORE_READ(task, tgid);
+    // Match the proc connector filter: only the thread group leader.
+    if (BPF_CORE_READ(task, pid) != tgid) {
+        return 0;
+    }
+    if (!bpf_map_lookup_elem(&tracked, &tgid)) {
+        return 0;
+    }
+    bpf_map_delete_elem(&tracked, &tgid);
+    emit(TRACKING_EVENT_EXIT, 0, tgid);
+    return 0;
+}
@@ -0,0 +1,38 @@
+// Small helpers shared by the daemon, its tools and its benchmarks.  Header
+// only, so the standalone tools need nothing else linked in.
+
+#ifndef __PROC_UTIL_H
+#define __PROC_UTIL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Larger than any pid the kernel can hand out (PID_MAX_LIMIT is 4M), so
+// replayed and synthetic trees never collide with real processes.
+#define FAKE_PID_BASE 5000000
+
+static inline pid_t fake_pid(pid_t pid) {
+    return (pid > 1) ? pid + FAKE_PID_BASE : pid;
+}
+
+// CLOCK_MONOTONIC, in nanoseconds.
+static inline uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline double ms_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif